@@ -0,0 +1,161 @@
+/*
+ * Compare the data path copy kernels against glibc memcpy.
+ *
+ * Transfers are split across 1 MB extents the same way FileSystem::read and
+ * FileSystem::write split them. After each transfer a small "metadata" working
+ * set is walked, and the time it takes shows how much of it the transfer
+ * evicted from the cache.
+ *
+ *   usage: copy_bench [file size in mb]
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "datapath.h"
+
+static const size_t extent_size = 1ULL << 20;
+
+struct File {
+    explicit File(size_t size) {
+        for (size_t off = 0; off < size; off += extent_size) {
+            extents.emplace_back(new char[extent_size]);
+            std::memset(extents.back().get(), 1, extent_size);
+        }
+    }
+
+    size_t size() const { return extents.size() * extent_size; }
+
+    std::vector<std::unique_ptr<char[]>> extents;
+};
+
+typedef void (*copy_fn)(void* dst, const void* src, size_t n);
+
+static void libc_copy(void* dst, const void* src, size_t n) {
+    std::memcpy(dst, src, n);
+}
+
+static void
+write_file(File& f, size_t off, const char* buf, size_t n, copy_fn fn) {
+    while (n) {
+        size_t blkoff = off % extent_size;
+        size_t done = std::min(n, extent_size - blkoff);
+        fn(f.extents[off / extent_size].get() + blkoff, buf, done);
+        off += done;
+        buf += done;
+        n -= done;
+    }
+}
+
+static void read_file(File& f, size_t off, char* buf, size_t n, copy_fn fn) {
+    while (n) {
+        size_t blkoff = off % extent_size;
+        size_t done = std::min(n, extent_size - blkoff);
+        fn(buf, f.extents[off / extent_size].get() + blkoff, done);
+        off += done;
+        buf += done;
+        n -= done;
+    }
+}
+
+// stands in for the inode table and dentries the metadata paths walk
+struct Probe {
+    Probe()
+      : lines((4ULL << 20) / sizeof(Line)) {}
+
+    double walk() {
+        auto start = std::chrono::steady_clock::now();
+        for (auto& line : lines)
+            line.v[0]++;
+        auto end = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::nano>(end - start).count()
+               / lines.size();
+    }
+
+    struct alignas(64) Line {
+        long v[8];
+    };
+    std::vector<Line> lines;
+};
+
+struct Result {
+    double gbps;
+    double probe_ns;
+};
+
+static Result
+run(File& f, char* buf, size_t xfer, bool write, copy_fn fn, Probe& probe) {
+    const size_t total = std::max(f.size(), xfer * 8);
+    const size_t sample = std::min(16 * extent_size, f.size());
+    size_t off = 0, moved = 0, walks = 0;
+    double elapsed = 0, probe_ns = 0;
+
+    probe.walk();
+    while (moved < total) {
+        if (off + xfer > f.size()) off = 0;
+        auto start = std::chrono::steady_clock::now();
+        if (write)
+            write_file(f, off, buf, xfer, fn);
+        else
+            read_file(f, off, buf, xfer, fn);
+        auto end = std::chrono::steady_clock::now();
+        elapsed += std::chrono::duration<double>(end - start).count();
+        off += xfer;
+        moved += xfer;
+
+        // sample the working set every so often so small transfers aren't
+        // dominated by the probe itself
+        if (moved % sample < xfer || xfer >= sample) {
+            probe_ns += probe.walk();
+            walks++;
+        }
+    }
+
+    return Result{moved / elapsed / 1e9, walks ? probe_ns / walks : 0};
+}
+
+int main(int argc, char* argv[]) {
+    size_t file_mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 256;
+    if (!file_mb) {
+        fprintf(stderr, "usage: %s [file size in mb]\n", argv[0]);
+        return 1;
+    }
+    File f(file_mb * extent_size);
+    Probe probe;
+
+    const size_t max_xfer = 64ULL << 20;
+    std::unique_ptr<char[]> buf(new char[max_xfer]);
+    std::memset(buf.get(), 2, max_xfer);
+
+    printf("kernel: %s, file: %zu mb\n", datapath_kernel_name(), file_mb);
+    printf(
+      "%-6s %10s | %10s %10s | %10s %10s\n",
+      "op",
+      "xfer",
+      "libc gb/s",
+      "probe ns",
+      "nt gb/s",
+      "probe ns");
+
+    for (int write = 0; write < 2; write++) {
+        // transfers stop at the size of the file
+        for (size_t xfer = 4096; xfer <= std::min(max_xfer, f.size());
+             xfer *= 4) {
+            auto libc = run(f, buf.get(), xfer, write, libc_copy, probe);
+            auto nt = run(f, buf.get(), xfer, write, stream_copy, probe);
+            printf(
+              "%-6s %10zu | %10.2f %10.2f | %10.2f %10.2f\n",
+              write ? "write" : "read",
+              xfer,
+              libc.gbps,
+              libc.probe_ns,
+              nt.gbps,
+              nt.probe_ns);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * Measure what it costs to dispatch a request to the file system.
+ *
+ * fuse calls an operation through its table of function pointers, and the
+ * trampoline then calls into the file system. The trampolines here are shaped
+ * like those in filesystem.h, once binding a getattr-sized operation at
+ * compile time and once through a virtual call, so the difference between the
+ * two is the cost of the indirect call on this machine (including any
+ * retpoline the compiler inserts).
+ *
+ *   usage: dispatch_bench [million calls]
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+
+// a small operation, like filling in the attributes of a cached inode
+struct Inode {
+    struct stat st;
+};
+
+static Inode inodes[64];
+
+template <typename Derived>
+struct Base {
+    static int ll_getattr(void* userdata, unsigned long ino, struct stat* st) {
+        return static_cast<Derived*>(userdata)->getattr(ino, st);
+    }
+};
+
+struct Static : Base<Static> {
+    int getattr(unsigned long ino, struct stat* st) {
+        *st = inodes[ino % 64].st;
+        return 0;
+    }
+};
+
+struct Virtual : Base<Virtual> {
+    virtual ~Virtual() = default;
+    virtual int getattr(unsigned long ino, struct stat* st) = 0;
+};
+
+struct VirtualImpl : Virtual {
+    int getattr(unsigned long ino, struct stat* st) override {
+        *st = inodes[ino % 64].st;
+        return 0;
+    }
+};
+
+typedef int (*op_t)(void*, unsigned long, struct stat*);
+
+// the compiler can't see through the table, as with fuse_lowlevel_ops
+static double run(op_t volatile op, void* volatile userdata, size_t calls) {
+    struct stat st;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < calls; i++)
+        op(userdata, i, &st);
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count()
+           / calls;
+}
+
+int main(int argc, char* argv[]) {
+    const size_t calls = (argc > 1 ? strtoul(argv[1], NULL, 10) : 100)
+                         * 1000000;
+
+    for (int i = 0; i < 64; i++) {
+        std::memset(&inodes[i].st, 0, sizeof(inodes[i].st));
+        inodes[i].st.st_ino = i;
+    }
+
+    Static s;
+    VirtualImpl v;
+
+    // warm up
+    run(Static::ll_getattr, &s, calls / 10);
+    run(Virtual::ll_getattr, static_cast<Virtual*>(&v), calls / 10);
+
+    const double static_ns = run(Static::ll_getattr, &s, calls);
+    const double virtual_ns = run(
+      Virtual::ll_getattr, static_cast<Virtual*>(&v), calls);
+
+    printf("%10s | %10s\n", "dispatch", "ns/op");
+    printf("%10s | %10.2f\n", "static", static_ns);
+    printf("%10s | %10.2f\n", "virtual", virtual_ns);
+
+    return 0;
+}
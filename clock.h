@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+
+/*
+ * Inode timestamps.
+ *
+ * Times come from the coarse realtime clock, which the kernel updates once a
+ * tick and the vdso reads without a system call, so stamping an operation
+ * costs a couple of loads rather than a trip into the kernel. The resolution
+ * is a tick instead of a second, which is enough for make to see that a file
+ * written after another one is newer.
+ *
+ * Times that are read without the file system lock are kept as nanoseconds
+ * since the epoch so that they fit in an atomic.
+ */
+inline struct timespec coarse_now() {
+    struct timespec ts;
+#ifdef CLOCK_REALTIME_COARSE
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+    return ts;
+}
+
+inline int64_t to_ns(const struct timespec& ts) {
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+inline struct timespec from_ns(int64_t ns) {
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    if (ts.tv_nsec < 0) {
+        ts.tv_sec--;
+        ts.tv_nsec += 1000000000;
+    }
+    return ts;
+}
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Data movement kernels for the extent data path.
+ *
+ * Small transfers use the libc routines. Transfers of at least
+ * datapath_stream_threshold bytes are copied with non-temporal stores so that
+ * streaming megabytes through the file system doesn't evict the metadata
+ * working set from the last level cache. The widest kernel the cpu supports
+ * (AVX-512, AVX2, or the SSE2 baseline of x86-64) is picked at runtime.
+ */
+inline size_t datapath_stream_threshold = 1ULL << 20;
+
+static inline bool datapath_stream(size_t transfer) {
+    return transfer >= datapath_stream_threshold;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx512f"))) static inline void
+stream_copy_avx512(char* dst, const char* src, size_t n) {
+    for (; n >= 64; n -= 64, dst += 64, src += 64) {
+        __m512i v = _mm512_loadu_si512(src);
+        _mm512_stream_si512(reinterpret_cast<__m512i*>(dst), v);
+    }
+    _mm_sfence();
+    std::memcpy(dst, src, n);
+}
+
+__attribute__((target("avx2"))) static inline void
+stream_copy_avx2(char* dst, const char* src, size_t n) {
+    for (; n >= 64; n -= 64, dst += 64, src += 64) {
+        auto s = reinterpret_cast<const __m256i*>(src);
+        auto d = reinterpret_cast<__m256i*>(dst);
+        __m256i a = _mm256_loadu_si256(s);
+        __m256i b = _mm256_loadu_si256(s + 1);
+        _mm256_stream_si256(d, a);
+        _mm256_stream_si256(d + 1, b);
+    }
+    _mm_sfence();
+    std::memcpy(dst, src, n);
+}
+
+static inline void stream_copy_sse2(char* dst, const char* src, size_t n) {
+    for (; n >= 64; n -= 64, dst += 64, src += 64) {
+        auto s = reinterpret_cast<const __m128i*>(src);
+        auto d = reinterpret_cast<__m128i*>(dst);
+        __m128i a = _mm_loadu_si128(s);
+        __m128i b = _mm_loadu_si128(s + 1);
+        __m128i c = _mm_loadu_si128(s + 2);
+        __m128i e = _mm_loadu_si128(s + 3);
+        _mm_stream_si128(d, a);
+        _mm_stream_si128(d + 1, b);
+        _mm_stream_si128(d + 2, c);
+        _mm_stream_si128(d + 3, e);
+    }
+    _mm_sfence();
+    std::memcpy(dst, src, n);
+}
+
+__attribute__((target("avx512f"))) static inline void
+stream_zero_avx512(char* dst, size_t n) {
+    const __m512i zero = _mm512_setzero_si512();
+    for (; n >= 64; n -= 64, dst += 64)
+        _mm512_stream_si512(reinterpret_cast<__m512i*>(dst), zero);
+    _mm_sfence();
+    std::memset(dst, 0, n);
+}
+
+__attribute__((target("avx2"))) static inline void
+stream_zero_avx2(char* dst, size_t n) {
+    const __m256i zero = _mm256_setzero_si256();
+    for (; n >= 64; n -= 64, dst += 64) {
+        auto d = reinterpret_cast<__m256i*>(dst);
+        _mm256_stream_si256(d, zero);
+        _mm256_stream_si256(d + 1, zero);
+    }
+    _mm_sfence();
+    std::memset(dst, 0, n);
+}
+
+static inline void stream_zero_sse2(char* dst, size_t n) {
+    const __m128i zero = _mm_setzero_si128();
+    for (; n >= 64; n -= 64, dst += 64) {
+        auto d = reinterpret_cast<__m128i*>(dst);
+        _mm_stream_si128(d, zero);
+        _mm_stream_si128(d + 1, zero);
+        _mm_stream_si128(d + 2, zero);
+        _mm_stream_si128(d + 3, zero);
+    }
+    _mm_sfence();
+    std::memset(dst, 0, n);
+}
+
+struct stream_kernels {
+    void (*copy)(char* dst, const char* src, size_t n);
+    void (*zero)(char* dst, size_t n);
+    const char* name;
+};
+
+static inline const stream_kernels& datapath_kernels() {
+    static const stream_kernels kernels = [] {
+        if (__builtin_cpu_supports("avx512f"))
+            return stream_kernels{
+              stream_copy_avx512, stream_zero_avx512, "avx512"};
+        if (__builtin_cpu_supports("avx2"))
+            return stream_kernels{stream_copy_avx2, stream_zero_avx2, "avx2"};
+        return stream_kernels{stream_copy_sse2, stream_zero_sse2, "sse2"};
+    }();
+    return kernels;
+}
+
+static inline const char* datapath_kernel_name() {
+    return datapath_kernels().name;
+}
+
+/*
+ * Non-temporal stores need an aligned destination, so the unaligned head is
+ * handled by libc and the stream kernel takes care of the rest.
+ */
+static inline void stream_copy(void* dst, const void* src, size_t n) {
+    auto d = static_cast<char*>(dst);
+    auto s = static_cast<const char*>(src);
+    size_t head = std::min(n, (size_t)(-(uintptr_t)d & 63));
+    std::memcpy(d, s, head);
+    datapath_kernels().copy(d + head, s + head, n - head);
+}
+
+static inline void stream_zero(void* dst, size_t n) {
+    auto d = static_cast<char*>(dst);
+    size_t head = std::min(n, (size_t)(-(uintptr_t)d & 63));
+    std::memset(d, 0, head);
+    datapath_kernels().zero(d + head, n - head);
+}
+#else
+static inline const char* datapath_kernel_name() { return "libc"; }
+
+static inline void stream_copy(void* dst, const void* src, size_t n) {
+    std::memcpy(dst, src, n);
+}
+
+static inline void stream_zero(void* dst, size_t n) { std::memset(dst, 0, n); }
+#endif
+
+/*
+ * Copy or zero one segment of a transfer. @stream is normally the result of
+ * datapath_stream() for the size of the whole transfer, which may be split
+ * into many segments along extent boundaries.
+ */
+static inline void
+data_copy(void* dst, const void* src, size_t n, bool stream) {
+    if (stream)
+        stream_copy(dst, src, n);
+    else
+        std::memcpy(dst, src, n);
+}
+
+static inline void data_zero(void* dst, size_t n, bool stream) {
+    if (stream)
+        stream_zero(dst, n);
+    else
+        std::memset(dst, 0, n);
+}
+
+/*
+ * Returns true if @size bytes at @buf are all zero. The scan uses AVX2 when
+ * the cpu supports it, and SSE2 otherwise.
+ */
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static inline bool
+is_zero_avx2(const char* buf, size_t size) {
+    size_t i = 0;
+    for (; i + 128 <= size; i += 128) {
+        auto p = reinterpret_cast<const __m256i*>(buf + i);
+        __m256i a = _mm256_or_si256(
+          _mm256_loadu_si256(p), _mm256_loadu_si256(p + 1));
+        __m256i b = _mm256_or_si256(
+          _mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3));
+        __m256i v = _mm256_or_si256(a, b);
+        if (!_mm256_testz_si256(v, v)) return false;
+    }
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(buf + i));
+        if (!_mm256_testz_si256(v, v)) return false;
+    }
+    for (; i < size; i++)
+        if (buf[i]) return false;
+    return true;
+}
+
+static inline bool is_zero_sse2(const char* buf, size_t size) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        auto p = reinterpret_cast<const __m128i*>(buf + i);
+        __m128i v = _mm_or_si128(
+          _mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+          _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff) return false;
+    }
+    for (; i < size; i++)
+        if (buf[i]) return false;
+    return true;
+}
+
+static inline bool is_zero(const char* buf, size_t size) {
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2 ? is_zero_avx2(buf, size) : is_zero_sse2(buf, size);
+}
+#else
+static inline bool is_zero(const char* buf, size_t size) {
+    for (size_t i = 0; i < size; i++)
+        if (buf[i]) return false;
+    return true;
+}
+#endif
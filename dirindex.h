@@ -0,0 +1,479 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "name.h"
+#include "ref.h"
+
+/*
+ * The entries of a directory, by name.
+ *
+ * A small directory is a vector of entries sorted by name. Once it grows past
+ * small_max entries it becomes a log of entries in the order they were added,
+ * indexed by an open addressing hash table:
+ *
+ * - Each slot of the table has a control byte holding 7 bits of the hash of
+ *   its entry, so a probe compares a group of 16 of them at once and only
+ *   looks at the entries whose bits match. The hash of each name is kept
+ *   with the entry, so it is computed once.
+ * - A bloom filter in front of the table answers most lookups of names that
+ *   aren't there without probing, which is what a build looking for headers
+ *   along a search path mostly does.
+ * - Entries get increasing readdir cookies as they are added, so the log is
+ *   in cookie order and a listing is a walk along it. Removed entries leave
+ *   a hole, and a run of the log is freed once all of its entries are gone.
+ *   When holes outnumber the entries, the log is rewritten without them.
+ *
+ * The table doesn't stop to rehash when it fills up. A bigger table takes
+ * new entries, and every change to the directory moves one group of slots
+ * over from the old table, which is looked in too until it is empty.
+ */
+template <typename I>
+class DirIndex {
+public:
+    struct Entry {
+        Name name;
+        Ref<I> inode; // null once removed
+        off_t cookie = 0;
+        size_t hash = 0;
+    };
+
+    DirIndex() = default;
+    DirIndex(const DirIndex&) = delete;
+    DirIndex& operator=(const DirIndex&) = delete;
+
+    size_t size() const { return size_; }
+
+    Entry* find(std::string_view name) {
+        if (!large_) {
+            auto it = std::lower_bound(
+              small_.begin(),
+              small_.end(),
+              name,
+              [](const Entry& e, std::string_view name) {
+                  return e.name < name;
+              });
+            return it != small_.end() && it->name == name ? &*it : nullptr;
+        }
+
+        const size_t hash = hash_name(name);
+        Entry* e = nullptr;
+        if (table_->may_contain(hash)) e = table_->find(*this, name, hash);
+        if (!e && old_ && old_->may_contain(hash))
+            e = old_->find(*this, name, hash);
+        return e;
+    }
+
+    /*
+     * Add an entry for a name that isn't in the directory, with the next
+     * cookie. Pointers to entries of a small directory are invalidated.
+     */
+    void add(std::string_view name, I* inode) {
+        Entry e;
+        e.name = Name(name);
+        e.inode = inode;
+        e.cookie = next_cookie_++;
+        e.hash = hash_name(name);
+        size_++;
+
+        if (!large_) {
+            auto it = std::lower_bound(
+              small_.begin(), small_.end(), e.name, [](auto& a, auto& b) {
+                  return a.name < b;
+              });
+            small_.insert(it, std::move(e));
+            if (small_.size() > small_max) make_large();
+            return;
+        }
+
+        const size_t hash = e.hash;
+        const uint32_t pos = append(std::move(e));
+        if (table_->needs_growth()) grow();
+        table_->insert(hash, pos);
+        migrate();
+    }
+
+    /*
+     * Pointers to other entries of a small directory, or of one whose log is
+     * compacted, are invalidated.
+     */
+    void remove(Entry* e) {
+        assert(e && e->inode);
+        size_--;
+
+        if (!large_) {
+            small_.erase(small_.begin() + (e - small_.data()));
+            return;
+        }
+
+        if (!table_->erase(*this, e) && !(old_ && old_->erase(*this, e)))
+            assert(0 == "entry not in the table");
+
+        const uint32_t pos = position(e);
+        Chunk* chunk = log_[pos / chunk_size].chunk.get();
+        e->name = Name();
+        e->inode.reset();
+        if (--chunk->live == 0 && pos / chunk_size + 1 < log_.size())
+            log_[pos / chunk_size].chunk.reset();
+
+        if (size_ <= small_max / 4) {
+            make_small();
+            return;
+        }
+
+        if (log_end_ - size_ > size_ + chunk_size) {
+            compact();
+            return;
+        }
+
+        migrate();
+    }
+
+    /*
+     * Call @f on each entry with a cookie of @from or more, in cookie order,
+     * until it returns false.
+     */
+    template <typename F>
+    void for_each(off_t from, F f) const {
+        if (!large_) {
+            const Entry* entries[small_max];
+            size_t n = 0;
+            for (auto& e : small_)
+                if (e.cookie >= from) entries[n++] = &e;
+            std::sort(entries, entries + n, [](auto a, auto b) {
+                return a->cookie < b->cookie;
+            });
+            for (size_t i = 0; i < n; i++)
+                if (!f(*entries[i])) return;
+            return;
+        }
+
+        for (auto it = chunk_of(from); it != log_.end(); ++it) {
+            if (!it->chunk) continue;
+            const size_t end = std::min(
+              chunk_size, log_end_ - (it - log_.begin()) * chunk_size);
+            for (size_t i = 0; i < end; i++) {
+                const Entry& e = it->chunk->entries[i];
+                if (e.inode && e.cookie >= from && !f(e)) return;
+            }
+        }
+    }
+
+private:
+    static constexpr size_t small_max = 32;
+    static constexpr size_t chunk_size = 256;
+    static constexpr size_t group_size = 16;
+
+    static size_t hash_name(std::string_view name) {
+        return std::hash<std::string_view>()(name);
+    }
+
+    struct Chunk {
+        Entry entries[chunk_size];
+        size_t live = 0;
+    };
+
+    // a run of the log, and the cookie of its first entry
+    struct ChunkRef {
+        off_t first;
+        std::unique_ptr<Chunk> chunk;
+    };
+
+    Entry& entry(uint32_t pos) {
+        return log_[pos / chunk_size].chunk->entries[pos % chunk_size];
+    }
+
+    typedef std::vector<ChunkRef> log_t;
+
+    // the run of the log where an entry with @cookie would be
+    typename log_t::const_iterator chunk_of(off_t cookie) const {
+        auto it = std::upper_bound(
+          log_.begin(),
+          log_.end(),
+          cookie,
+          [](off_t cookie, const ChunkRef& c) { return cookie < c.first; });
+        return it == log_.begin() ? it : it - 1;
+    }
+
+    uint32_t position(const Entry* e) const {
+        auto it = chunk_of(e->cookie);
+        assert(it->chunk.get() && e >= it->chunk->entries);
+        return (it - log_.begin()) * chunk_size + (e - it->chunk->entries);
+    }
+
+    uint32_t append(Entry&& e) {
+        assert(log_end_ < UINT32_MAX);
+        const uint32_t pos = log_end_++;
+        if (pos % chunk_size == 0)
+            log_.push_back(ChunkRef{e.cookie, std::make_unique<Chunk>()});
+        Chunk* chunk = log_.back().chunk.get();
+        chunk->entries[pos % chunk_size] = std::move(e);
+        chunk->live++;
+        return pos;
+    }
+
+    /*
+     * Slots hold positions in the log. A control byte is empty, deleted, or
+     * holds the low 7 bits of the hash of the entry in its slot, and the rest
+     * of the hash picks the group where probing starts.
+     */
+    class Table {
+    public:
+        explicit Table(size_t capacity)
+          : capacity_(capacity)
+          , ctrl_(new uint8_t[capacity])
+          , slots_(new uint32_t[capacity])
+          , bloom_(new uint64_t[capacity / 8]())
+          , bloom_mask_(capacity * 8 - 1) {
+            assert(capacity >= group_size);
+            assert((capacity & (capacity - 1)) == 0);
+            memset(ctrl_.get(), empty, capacity);
+        }
+
+        size_t capacity() const { return capacity_; }
+
+        // full and deleted slots count against the load
+        bool needs_growth() const { return (used_ + 1) * 8 > capacity_ * 7; }
+
+        bool may_contain(size_t hash) const {
+            const size_t a = hash & bloom_mask_;
+            const size_t b = (hash >> 32 | hash << 32) & bloom_mask_;
+            return (bloom_[a / 64] >> (a % 64) & 1)
+                   && (bloom_[b / 64] >> (b % 64) & 1);
+        }
+
+        Entry* find(DirIndex& dir, std::string_view name, size_t hash) {
+            const uint8_t tag = hash & 0x7f;
+            for (Probe p(hash, groups()); true; p.next()) {
+                const uint8_t* ctrl = ctrl_.get() + p.group * group_size;
+                for (uint32_t m = match(ctrl, tag); m; m &= m - 1) {
+                    const size_t slot = p.group * group_size + ffs(m) - 1;
+                    Entry& e = dir.entry(slots_[slot]);
+                    if (e.hash == hash && e.name == name) return &e;
+                }
+                if (match(ctrl, empty)) return nullptr;
+            }
+        }
+
+        void insert(size_t hash, uint32_t pos) {
+            for (Probe p(hash, groups()); true; p.next()) {
+                uint8_t* ctrl = ctrl_.get() + p.group * group_size;
+                if (uint32_t m = match(ctrl, empty) | match(ctrl, deleted)) {
+                    const size_t i = ffs(m) - 1;
+                    if (ctrl[i] == empty) used_++;
+                    ctrl[i] = hash & 0x7f;
+                    slots_[p.group * group_size + i] = pos;
+                    break;
+                }
+            }
+
+            const size_t a = hash & bloom_mask_;
+            const size_t b = (hash >> 32 | hash << 32) & bloom_mask_;
+            bloom_[a / 64] |= uint64_t(1) << (a % 64);
+            bloom_[b / 64] |= uint64_t(1) << (b % 64);
+        }
+
+        // returns false if the entry isn't in this table
+        bool erase(DirIndex& dir, const Entry* e) {
+            const uint8_t tag = e->hash & 0x7f;
+            for (Probe p(e->hash, groups()); true; p.next()) {
+                uint8_t* ctrl = ctrl_.get() + p.group * group_size;
+                for (uint32_t m = match(ctrl, tag); m; m &= m - 1) {
+                    const size_t i = ffs(m) - 1;
+                    if (&dir.entry(slots_[p.group * group_size + i]) == e) {
+                        clear(ctrl, i);
+                        return true;
+                    }
+                }
+                if (match(ctrl, empty)) return false;
+            }
+        }
+
+        /*
+         * Move the entries in group @g to @to, and return whether it was the
+         * last group.
+         */
+        bool move_group(size_t g, DirIndex& dir, Table* to) {
+            uint8_t* ctrl = ctrl_.get() + g * group_size;
+            for (size_t i = 0; i < group_size; i++) {
+                if (ctrl[i] & 0x80) continue;
+                const uint32_t pos = slots_[g * group_size + i];
+                to->insert(dir.entry(pos).hash, pos);
+                // deleted, not empty, so that probes carry on past it
+                ctrl[i] = deleted;
+            }
+            return g + 1 == groups();
+        }
+
+        template <typename F>
+        void for_each_slot(F f) const {
+            for (size_t i = 0; i < capacity_; i++)
+                if (!(ctrl_[i] & 0x80)) f(slots_[i]);
+        }
+
+    private:
+        static constexpr uint8_t empty = 0x80;
+        static constexpr uint8_t deleted = 0xfe;
+
+        // groups are visited in triangular steps, which reaches all of them
+        struct Probe {
+            Probe(size_t hash, size_t groups)
+              : mask(groups - 1)
+              , group((hash >> 7) & mask) {}
+
+            void next() { group = (group + ++step) & mask; }
+
+            const size_t mask;
+            size_t group;
+            size_t step = 0;
+        };
+
+        size_t groups() const { return capacity_ / group_size; }
+
+        // a bit for each byte of the group that equals @b
+        static uint32_t match(const uint8_t* ctrl, uint8_t b) {
+#if defined(__SSE2__)
+            const __m128i group
+              = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+            return _mm_movemask_epi8(
+              _mm_cmpeq_epi8(group, _mm_set1_epi8(static_cast<char>(b))));
+#else
+            uint32_t m = 0;
+            for (size_t i = 0; i < group_size; i++)
+                m |= uint32_t(ctrl[i] == b) << i;
+            return m;
+#endif
+        }
+
+        static int ffs(uint32_t m) { return __builtin_ffs(m); }
+
+        /*
+         * A probe only goes past a group that has no empty slots, so a slot
+         * can be emptied if its group still has one. Otherwise it is marked
+         * deleted and still counts against the load.
+         */
+        void clear(uint8_t* ctrl, size_t i) {
+            if (match(ctrl, empty)) {
+                ctrl[i] = empty;
+                used_--;
+            } else {
+                ctrl[i] = deleted;
+            }
+        }
+
+        const size_t capacity_;
+        size_t used_ = 0;
+        std::unique_ptr<uint8_t[]> ctrl_;
+        std::unique_ptr<uint32_t[]> slots_;
+        std::unique_ptr<uint64_t[]> bloom_;
+        const size_t bloom_mask_;
+    };
+
+    /*
+     * A table with room for the entries at under half load, so that the
+     * entries still in the old table move over well before this one fills.
+     */
+    size_t table_capacity() const {
+        size_t capacity = group_size * 2;
+        while (capacity * 7 / 16 < size_)
+            capacity *= 2;
+        return capacity;
+    }
+
+    void make_large() {
+        assert(!large_);
+        std::sort(small_.begin(), small_.end(), [](auto& a, auto& b) {
+            return a.cookie < b.cookie;
+        });
+        table_ = std::make_unique<Table>(table_capacity());
+        for (auto& e : small_) {
+            const size_t hash = e.hash;
+            table_->insert(hash, append(std::move(e)));
+        }
+        small_.clear();
+        small_.shrink_to_fit();
+        large_ = true;
+    }
+
+    void make_small() {
+        assert(large_);
+        small_.reserve(small_max);
+        for (auto& c : log_) {
+            if (!c.chunk) continue;
+            for (auto& e : c.chunk->entries)
+                if (e.inode) small_.push_back(std::move(e));
+        }
+        std::sort(small_.begin(), small_.end(), [](auto& a, auto& b) {
+            return a.name < b.name;
+        });
+        log_.clear();
+        log_end_ = 0;
+        table_.reset();
+        old_.reset();
+        large_ = false;
+    }
+
+    /*
+     * Rewrite the log with only the entries that are left, in the same order
+     * and with the same cookies so that listings carry on where they were,
+     * and index it with a new table.
+     */
+    void compact() {
+        log_t log;
+        log.swap(log_);
+        log_end_ = 0;
+        old_.reset();
+        table_ = std::make_unique<Table>(table_capacity());
+        for (auto& c : log) {
+            if (!c.chunk) continue;
+            for (auto& e : c.chunk->entries) {
+                if (!e.inode) continue;
+                const size_t hash = e.hash;
+                table_->insert(hash, append(std::move(e)));
+            }
+        }
+    }
+
+    /*
+     * Start moving to a new table. It is sized for the entries that are
+     * left, so a table that filled up with deleted slots is replaced by one
+     * of the same size.
+     */
+    void grow() {
+        while (old_)
+            migrate();
+        old_ = std::make_unique<Table>(table_capacity());
+        std::swap(old_, table_);
+        migrate_group_ = 0;
+    }
+
+    void migrate() {
+        if (!old_) return;
+        if (old_->move_group(migrate_group_++, *this, table_.get()))
+            old_.reset();
+    }
+
+    bool large_ = false;
+    size_t size_ = 0;
+    off_t next_cookie_ = 2;
+
+    std::vector<Entry> small_;
+
+    log_t log_;
+    size_t log_end_ = 0;
+    std::unique_ptr<Table> table_;
+    std::unique_ptr<Table> old_;
+    size_t migrate_group_ = 0;
+};
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*
+ * Epoch based reclamation for data that is read without locks.
+ *
+ * A reader pins the current epoch with an EpochGuard for as long as it holds
+ * pointers into published data. A writer that unpublishes an object retires
+ * it instead of freeing it, and it is freed once no reader is pinned at an
+ * epoch that could have seen it. Pinning is a store to a per-thread slot, so
+ * readers never wait on writers.
+ */
+class EpochDomain {
+public:
+    template<typename T>
+    void retire(const T* p) {
+        retire(const_cast<T*>(p), [](void* p) { delete static_cast<T*>(p); });
+    }
+
+    void retire(void* p, void (*free)(void*)) {
+        // objects retired at epoch e may still be seen by readers that pinned
+        // e before it was advanced.
+        const uint64_t epoch = epoch_.fetch_add(1);
+        std::lock_guard<std::mutex> l(limbo_mutex_);
+        limbo_.push_back(Retired{epoch, p, free});
+    }
+
+    // free retired objects that no reader can see anymore
+    void reclaim() {
+        std::lock_guard<std::mutex> l(limbo_mutex_);
+        if (limbo_.empty()) return;
+
+        const uint64_t oldest = oldest_pinned();
+        while (!limbo_.empty() && limbo_.front().epoch < oldest) {
+            limbo_.front().free(limbo_.front().p);
+            limbo_.pop_front();
+        }
+    }
+
+    // free everything. only safe once there can be no readers.
+    void drain() {
+        std::lock_guard<std::mutex> l(limbo_mutex_);
+        for (auto& r : limbo_)
+            r.free(r.p);
+        limbo_.clear();
+    }
+
+    ~EpochDomain() { drain(); }
+
+private:
+    friend class EpochGuard;
+
+    struct Slot {
+        std::atomic<uint64_t> epoch{0};
+        int depth = 0;
+    };
+
+    /*
+     * Each thread gets a slot the first time it pins an epoch, and gives it
+     * back when it exits.
+     */
+    class SlotHandle {
+    public:
+        explicit SlotHandle(EpochDomain* domain)
+          : domain_(domain)
+          , slot_(new Slot) {
+            std::lock_guard<std::mutex> l(domain_->slots_mutex_);
+            domain_->slots_.push_back(slot_.get());
+        }
+
+        ~SlotHandle() {
+            std::lock_guard<std::mutex> l(domain_->slots_mutex_);
+            auto& slots = domain_->slots_;
+            for (auto it = slots.begin(); it != slots.end(); it++) {
+                if (*it == slot_.get()) {
+                    slots.erase(it);
+                    break;
+                }
+            }
+        }
+
+        Slot* slot() const { return slot_.get(); }
+
+    private:
+        EpochDomain* domain_;
+        std::unique_ptr<Slot> slot_;
+    };
+
+    Slot* slot() {
+        thread_local SlotHandle handle(this);
+        return handle.slot();
+    }
+
+    uint64_t oldest_pinned() {
+        uint64_t oldest = UINT64_MAX;
+        std::lock_guard<std::mutex> l(slots_mutex_);
+        for (auto slot : slots_) {
+            uint64_t epoch = slot->epoch.load();
+            if (epoch && epoch < oldest) oldest = epoch;
+        }
+        return oldest;
+    }
+
+    struct Retired {
+        uint64_t epoch;
+        void* p;
+        void (*free)(void*);
+    };
+
+    // starts at 1 so that 0 can mark an idle slot
+    std::atomic<uint64_t> epoch_{1};
+
+    std::mutex slots_mutex_;
+    std::vector<Slot*> slots_;
+
+    std::mutex limbo_mutex_;
+    std::deque<Retired> limbo_;
+};
+
+/*
+ * The process wide domain. Thread slots are tied to a single domain, so
+ * everything shares this one.
+ */
+static inline EpochDomain& epochs() {
+    static EpochDomain domain;
+    return domain;
+}
+
+class EpochGuard {
+public:
+    explicit EpochGuard(EpochDomain& domain)
+      : slot_(domain.slot()) {
+        if (slot_->depth++ == 0) slot_->epoch.store(domain.epoch_.load());
+    }
+
+    ~EpochGuard() {
+        if (--slot_->depth == 0)
+            slot_->epoch.store(0, std::memory_order_release);
+    }
+
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+
+private:
+    EpochDomain::Slot* slot_;
+};
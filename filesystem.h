@@ -1,7 +1,9 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <cerrno>
 #include <cstring>
 #include <fuse.h>
 #include <fuse_lowlevel.h>
@@ -9,15 +11,93 @@
 #include <memory>
 #include <mutex>
 #include <string>
+#include <string_view>
+#include <tuple>
 #include <unordered_map>
 #include <linux/limits.h>
 
+#include "pool.h"
+#include "scheduler.h"
+#include "throttle.h"
+
 struct FileHandle;
+struct DirHandle;
+
+/*
+ * A copy of a request argument, for a request that is queued to run after the
+ * thread that received it has moved on. Names and the data of writes point
+ * into the receive buffer, and file info and attributes into its stack, so
+ * those are copied. Other arguments are plain values.
+ */
+template <typename T>
+struct held_arg {
+    explicit held_arg(T v)
+      : v(v) {}
+    T get() { return v; }
+    T v;
+};
+
+template <>
+struct held_arg<const char*> {
+    explicit held_arg(const char* s)
+      : s(s) {}
+    const char* get() { return s.c_str(); }
+    std::string s;
+};
+
+template <typename T>
+struct held_struct {
+    explicit held_struct(T* p)
+      : null(!p) {
+        if (p) v = *p;
+    }
+    T* get() { return null ? nullptr : &v; }
+    T v;
+    bool null;
+};
+
+template <>
+struct held_arg<struct fuse_file_info*> : held_struct<struct fuse_file_info> {
+    using held_struct::held_struct;
+};
+
+template <>
+struct held_arg<struct stat*> : held_struct<struct stat> {
+    using held_struct::held_struct;
+};
+
+template <>
+struct held_arg<struct fuse_bufvec*> {
+    explicit held_arg(struct fuse_bufvec* src) {
+        const size_t size = fuse_buf_size(src);
+        mem.reset(new char[size]);
+        struct fuse_bufvec init = FUSE_BUFVEC_INIT(size);
+        bufv = init;
+        bufv.buf[0].mem = mem.get();
+        // the copy advances the vectors it is given
+        struct fuse_bufvec dst = bufv;
+        fuse_buf_copy(&dst, src, (enum fuse_buf_copy_flags)0);
+    }
+    struct fuse_bufvec* get() { return &bufv; }
+    std::unique_ptr<char[]> mem;
+    struct fuse_bufvec bufv;
+};
 
+/*
+ * Binds the fuse lowlevel operations to a file system implementation.
+ *
+ * The implementation derives from filesystem_base<Implementation> and
+ * provides the operations listed in virtual_filesystem below, which the
+ * trampolines call directly, so a small request like getattr costs no
+ * indirect call and can be inlined into its trampoline. The implementation
+ * is passed to fuse as the session userdata.
+ */
+template <typename Derived>
 class filesystem_base {
 public:
     filesystem_base() {
         std::memset(&ops_, 0, sizeof(ops_));
+        ops_.init = ll_init;
         ops_.destroy = ll_destroy;
         ops_.create = ll_create;
         ops_.release = ll_release;
@@ -48,126 +128,181 @@ public:
 
     const fuse_lowlevel_ops& ops() const { return ops_; }
 
-public:
-    virtual void destroy() = 0;
-    virtual int
-    lookup(fuse_ino_t parent_ino, const std::string& name, struct stat* st)
-      = 0;
-    virtual void forget(fuse_ino_t ino, long unsigned nlookup) = 0;
-    virtual int statfs(fuse_ino_t ino, struct statvfs* stbuf) = 0;
-
-    virtual int mknod(
-      fuse_ino_t parent_ino,
-      const std::string& name,
-      mode_t mode,
-      dev_t rdev,
-      struct stat* st,
-      uid_t uid,
-      gid_t gid)
-      = 0;
-
-    virtual int symlink(
-      const std::string& link,
-      fuse_ino_t parent_ino,
-      const std::string& name,
-      struct stat* st,
-      uid_t uid,
-      gid_t gid)
-      = 0;
-
-    virtual int link(
-      fuse_ino_t ino,
-      fuse_ino_t newparent_ino,
-      const std::string& newname,
-      struct stat* st,
-      uid_t uid,
-      gid_t gid)
-      = 0;
-
-    virtual int rename(
-      fuse_ino_t parent_ino,
-      const std::string& name,
-      fuse_ino_t newparent_ino,
-      const std::string& newname,
-      uid_t uid,
-      gid_t gid)
-      = 0;
+    // the channel that notifications are sent on, once the session is up
+    void set_chan(struct fuse_chan* ch) { chan_ = ch; }
+
+protected:
+    // how long the kernel may cache the entries and attributes in replies,
+    // in seconds. a negative entry is a lookup miss.
+    double entry_timeout_ = 0.0;
+    double attr_timeout_ = 0.0;
+    double negative_timeout_ = 0.0;
+
+    // the largest read and write requests to ask the kernel for, in bytes
+    size_t max_write_ = 1 << 20;
+    size_t max_read_ = 1 << 20;
+
+    // requests wait for the scheduler to admit them, if there is one. reads
+    // and writes of at least bulk_size_ bytes are bulk transfers.
+    std::unique_ptr<Scheduler> sched_;
+    size_t bulk_size_ = 128 << 10;
+
+    // requests from tenants over their limits are held back before they
+    // are admitted, so they don't sit on a slot while they wait
+    std::unique_ptr<Throttle> throttle_;
+
+    /*
+     * Admit a request that is handled by the trampoline @op with @args. If
+     * it can't run yet, because its tenant is over its limits or there is no
+     * free slot, it is held or queued with copies of its arguments, and the
+     * returned ticket is empty: the trampoline returns, and is called again
+     * with the copies once the request may go ahead.
+     */
+    template <typename... Params, typename... Args>
+    Scheduler::Ticket admit(
+      fuse_req_t req,
+      Scheduler::op_class c,
+      void (*op)(fuse_req_t, Params...),
+      Args... args) {
+        return admit_request(req, c, 0, true, op, args...);
+    }
 
-    virtual int
-    unlink(fuse_ino_t parent_ino, const std::string& name, uid_t uid, gid_t gid)
-      = 0;
+    template <typename... Params, typename... Args>
+    Scheduler::Ticket admit_io(
+      fuse_req_t req,
+      size_t size,
+      void (*op)(fuse_req_t, Params...),
+      Args... args) {
+        const auto c
+          = size >= bulk_size_ ? Scheduler::BULK_IO : Scheduler::SMALL_IO;
+        return admit_request(req, c, size, true, op, args...);
+    }
 
-    virtual int access(fuse_ino_t ino, int mask, uid_t uid, gid_t gid) = 0;
+    // giving back file handles is never throttled
+    template <typename... Params, typename... Args>
+    Scheduler::Ticket admit_release(
+      fuse_req_t req, void (*op)(fuse_req_t, Params...), Args... args) {
+        return admit_request(req, Scheduler::META, 0, false, op, args...);
+    }
 
-    virtual int getattr(fuse_ino_t ino, struct stat* st, uid_t uid, gid_t gid)
-      = 0;
+    void fill_entry(struct fuse_entry_param* fe) const {
+        fe->ino = fe->attr.st_ino;
+        fe->generation = 0;
+        fe->entry_timeout = entry_timeout_;
+        fe->attr_timeout = attr_timeout_;
+    }
 
-    virtual int setattr(
-      fuse_ino_t ino,
-      FileHandle* fh,
-      struct stat* attr,
-      int to_set,
-      uid_t uid,
-      gid_t gid)
-      = 0;
+    /*
+     * Drop cached state in the kernel. These wait on the kernel, which may
+     * need the locks held for a request that is in progress, so they must
+     * not be called while handling a request.
+     */
+    int notify_inval_inode(fuse_ino_t ino, off_t off, off_t len) {
+        struct fuse_chan* ch = chan_;
+        if (!ch) return -ENOTCONN;
+        return fuse_lowlevel_notify_inval_inode(ch, ino, off, len);
+    }
 
-    virtual ssize_t
-    readlink(fuse_ino_t ino, char* path, size_t maxlen, uid_t uid, gid_t gid)
-      = 0;
+    int notify_inval_entry(fuse_ino_t parent, const std::string& name) {
+        struct fuse_chan* ch = chan_;
+        if (!ch) return -ENOTCONN;
+        return fuse_lowlevel_notify_inval_entry(
+          ch, parent, name.c_str(), name.size());
+    }
 
-    virtual int mkdir(
-      fuse_ino_t parent_ino,
-      const std::string& name,
-      mode_t mode,
-      struct stat* st,
-      uid_t uid,
-      gid_t gid)
-      = 0;
+    int notify_store(fuse_ino_t ino, off_t off, const char* buf, size_t size) {
+        struct fuse_chan* ch = chan_;
+        if (!ch) return -ENOTCONN;
+        struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+        bufv.buf[0].mem = const_cast<char*>(buf);
+        return fuse_lowlevel_notify_store(
+          ch, ino, off, &bufv, (enum fuse_buf_copy_flags)0);
+    }
 
-    virtual int opendir(fuse_ino_t ino, int flags, uid_t uid, gid_t gid) = 0;
+private:
+    std::atomic<struct fuse_chan*> chan_{nullptr};
 
-    virtual ssize_t readdir(
-      fuse_req_t req, fuse_ino_t ino, char* buf, size_t bufsize, off_t off)
-      = 0;
+    // how a request that was held back or queued comes through admit()
+    // again: with its tokens taken, or with its slot as well
+    enum resume_state { FRESH, CHARGED, ADMITTED };
+    static inline thread_local resume_state resumed_ = FRESH;
 
-    virtual int
-    rmdir(fuse_ino_t parent_ino, const std::string& name, uid_t uid, gid_t gid)
-      = 0;
+    template <typename... Params, typename... Args>
+    static Scheduler::Task hold(
+      resume_state state,
+      fuse_req_t req,
+      void (*op)(fuse_req_t, Params...),
+      Args... args) {
+        auto held = std::make_shared<std::tuple<held_arg<Params>...>>(args...);
+        return [state, req, op, held] {
+            resumed_ = state;
+            std::apply([&](auto&... arg) { op(req, arg.get()...); }, *held);
+        };
+    }
 
-    virtual void releasedir(fuse_ino_t ino) = 0;
+    template <typename... Params, typename... Args>
+    Scheduler::Ticket admit_request(
+      fuse_req_t req,
+      Scheduler::op_class c,
+      size_t bytes,
+      bool throttled,
+      void (*op)(fuse_req_t, Params...),
+      Args... args) {
+        const resume_state state = resumed_;
+        resumed_ = FRESH;
+        if (state == ADMITTED) return Scheduler::Ticket(sched_.get(), c);
+
+        // a held request comes back on one of the throttle's workers
+        if (state == FRESH && throttled && throttle_) {
+            const struct fuse_ctx* ctx = fuse_req_ctx(req);
+            double wait = throttle_->charge(ctx->uid, ctx->gid, bytes);
+            if (wait > 0) {
+                throttle_->hold(wait, hold(CHARGED, req, op, args...));
+                return Scheduler::Ticket();
+            }
+        }
 
-    virtual int create(
-      fuse_ino_t parent_ino,
-      const std::string& name,
-      mode_t mode,
-      int flags,
-      struct stat* st,
-      FileHandle** fhp,
-      uid_t uid,
-      gid_t gid)
-      = 0;
+        // and then queues for a slot rather than running there, so that it
+        // can't keep the requests that come due after it waiting
+        if (!sched_ || (state == FRESH && sched_->try_enter(c)))
+            return Scheduler::Ticket(sched_.get(), c);
 
-    virtual int
-    open(fuse_ino_t ino, int flags, FileHandle** fhp, uid_t uid, gid_t gid)
-      = 0;
-    virtual ssize_t
-    write_buf(FileHandle* fh, struct fuse_bufvec* bufv, off_t off)
-      = 0;
-    virtual ssize_t read(FileHandle* fh, off_t offset, size_t size, char* buf)
-      = 0;
-    virtual void release(fuse_ino_t ino, FileHandle* fh) = 0;
+        sched_->defer(c, hold(ADMITTED, req, op, args...));
+        return Scheduler::Ticket();
+    }
 
-private:
-    static filesystem_base* get(fuse_req_t req) {
+    static Derived* get(fuse_req_t req) {
         return get(fuse_req_userdata(req));
     }
 
-    static filesystem_base* get(void* userdata) {
-        return reinterpret_cast<filesystem_base*>(userdata);
+    static Derived* get(void* userdata) {
+        return static_cast<Derived*>(userdata);
+    }
+
+    /*
+     * Ask for requests as large as the file system is configured for. Without
+     * big writes the kernel sends writes a page at a time. libfuse caps
+     * max_write at the size of its receive buffers, which is 128K for fuse 2.
+     * fuse 3 raises it to 1M and sizes max_pages to fit. Buffered reads are
+     * as large as the readahead window.
+     */
+    static void ll_init(void* userdata, struct fuse_conn_info* conn) {
+        auto fs = get(userdata);
+#ifdef FUSE_CAP_BIG_WRITES
+        if (conn->capable & FUSE_CAP_BIG_WRITES)
+            conn->want |= FUSE_CAP_BIG_WRITES;
+#endif
+        conn->max_write = std::min<size_t>(conn->max_write, fs->max_write_);
+        conn->max_readahead
+          = std::min<size_t>(conn->max_readahead, fs->max_read_);
+        fs->init(conn);
     }
 
+    // held and queued requests are run before the file system goes away
     static void ll_destroy(void* userdata) {
         auto fs = get(userdata);
+        if (fs->throttle_) fs->throttle_->stop();
+        if (fs->sched_) fs->sched_->stop();
         fs->destroy();
     }
 
@@ -178,6 +313,9 @@ private:
       mode_t mode,
       struct fuse_file_info* fi) {
         auto fs = get(req);
+        auto ticket = fs->admit(
+          req, Scheduler::META, ll_create, parent, name, mode, fi);
+        if (!ticket) return;
         const struct fuse_ctx* ctx = fuse_req_ctx(req);
 
         struct fuse_entry_param fe;
@@ -188,9 +326,8 @@ private:
           parent, name, mode, fi->flags, &fe.attr, &fh, ctx->uid, ctx->gid);
         if (ret == 0) {
             fi->fh = reinterpret_cast<uint64_t>(fh);
-            fe.ino = fe.attr.st_ino;
-            fe.generation = 0;
-            fe.entry_timeout = 1.0;
+            fs->open_reply(fh, fi);
+            fs->fill_entry(&fe);
             fuse_reply_create(req, &fe, fi);
         } else {
             fuse_reply_err(req, -ret);
@@ -200,6 +337,8 @@ private:
     static void
     ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
         auto fs = get(req);
+        auto ticket = fs->admit_release(req, ll_release, ino, fi);
+        if (!ticket) return;
         auto fh = reinterpret_cast<FileHandle*>(fi->fh);
 
         fs->release(ino, fh);
@@ -208,12 +347,15 @@ private:
 
     static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
         auto fs = get(req);
+        auto ticket = fs->admit(req, Scheduler::META, ll_unlink, parent, name);
+        if (!ticket) return;
         const struct fuse_ctx* ctx = fuse_req_ctx(req);
 
         int ret = fs->unlink(parent, name, ctx->uid, ctx->gid);
         fuse_reply_err(req, -ret);
     }
 
+    // forgets aren't scheduled. they are quick and nothing waits on them.
     static void
     ll_forget(fuse_req_t req, fuse_ino_t ino, long unsigned nlookup) {
         auto fs = get(req);
@@ -237,26 +379,33 @@ private:
     static void
     ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
         auto fs = get(req);
+        auto ticket = fs->admit(req, Scheduler::META, ll_getattr, ino, fi);
+        if (!ticket) return;
         const struct fuse_ctx* ctx = fuse_req_ctx(req);
 
         struct stat st;
         int ret = fs->getattr(ino, &st, ctx->uid, ctx->gid);
         if (ret == 0)
-            fuse_reply_attr(req, &st, ret);
+            fuse_reply_attr(req, &st, fs->attr_timeout_);
         else
             fuse_reply_err(req, -ret);
     }
 
     static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
         auto fs = get(req);
+        auto ticket = fs->admit(req, Scheduler::META, ll_lookup, parent, name);
+        if (!ticket) return;
 
         struct fuse_entry_param fe;
         std::memset(&fe, 0, sizeof(fe));
 
         int ret = fs->lookup(parent, name, &fe.attr);
         if (ret == 0) {
-            fe.ino = fe.attr.st_ino;
-            fe.generation = 0;
+            fs->fill_entry(&fe);
+            fuse_reply_entry(req, &fe);
+        } else if (ret == -ENOENT && fs->negative_timeout_ > 0) {
+            // an entry with a zero ino lets the kernel cache the miss
+            fe.entry_timeout = fs->negative_timeout_;
             fuse_reply_entry(req, &fe);
         } else {
             fuse_reply_err(req, -ret);
@@ -266,10 +415,14 @@ private:
     static void
     ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
         auto fs = get(req);
+        auto ticket = fs->admit(req, Scheduler::META, ll_opendir, ino, fi);
+        if (!ticket) return;
         const struct fuse_ctx* ctx = fuse_req_ctx(req);
 
-        int ret = fs->opendir(ino, fi->flags, ctx->uid, ctx->gid);
+        DirHandle* dh;
+        int ret = fs->opendir(ino, fi->flags, &dh, ctx->uid, ctx->gid);
         if (ret == 0) {
+            fi->fh = reinterpret_cast<uint64_t>(dh);
             fuse_reply_open(req, fi);
         } else {
             fuse_reply_err(req, -ret);
@@ -283,12 +436,16 @@ private:
       off_t off,
       struct fuse_file_info* fi) {
         auto fs = get(req);
+        auto ticket = fs->admit(
+          req, Scheduler::META, ll_readdir, ino, size, off, fi);
+        if (!ticket) return;
+        auto dh = reinterpret_cast<DirHandle*>(fi->fh);
 
-        auto buf = std::unique_ptr<char[]>(new char[size]);
+        char* buf = Scratch::buffer(size);
 
-        ssize_t ret = fs->readdir(req, ino, buf.get(), size, off);
+        ssize_t ret = fs->readdir(req, dh, buf, size, off);
         if (ret >= 0) {
-            fuse_reply_buf(req, buf.get(), (size_t)ret);
+            fuse_reply_buf(req, buf, (size_t)ret);
         } else {
             int r = (int)ret;
             fuse_reply_err(req, -r);
@@ -298,14 +455,19 @@ private:
     static void
     ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
         auto fs = get(req);
+        auto ticket = fs->admit_release(req, ll_releasedir, ino, fi);
+        if (!ticket) return;
+        auto dh = reinterpret_cast<DirHandle*>(fi->fh);
 
-        fs->releasedir(ino);
+        fs->releasedir(ino, dh);
         fuse_reply_err(req, 0);
     }
 
     static void
     ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
         auto fs = get(req);
+        auto ticket = fs->admit(req, Scheduler::META, ll_open, ino, fi);
+        if (!ticket) return;
         const struct fuse_ctx* ctx = fuse_req_ctx(req);
 
         // new files are handled by ll_create
@@ -315,6 +477,7 @@ private:
         int ret = fs->open(ino, fi->flags, &fh, ctx->uid, ctx->gid);
         if (ret == 0) {
             fi->fh = reinterpret_cast<uint64_t>(fh);
+            fs->open_reply(fh, fi);
             fuse_reply_open(req, fi);
         } else {
             fuse_reply_err(req, -ret);
@@ -328,6 +491,9 @@ private:
       off_t off,
       struct fuse_file_info* fi) {
         auto fs = get(req);
+        auto ticket = fs->admit_io(
+          req, fuse_buf_size(bufv), ll_write_buf, ino, bufv, off, fi);
+        if (!ticket) return;
         auto fh = reinterpret_cast<FileHandle*>(fi->fh);
 
         ssize_t ret = fs->write_buf(fh, bufv, off);
@@ -344,13 +510,15 @@ private:
       off_t off,
       struct fuse_file_info* fi) {
         auto fs = get(req);
+        auto ticket = fs->admit_io(req, size, ll_read, ino, size, off, fi);
+        if (!ticket) return;
         auto fh = reinterpret_cast<FileHandle*>(fi->fh);
 
-        auto buf = std::unique_ptr<char[]>(new char[size]);
+        char* buf = Scratch::buffer(size);
 
-        ssize_t ret = fs->read(fh, off, size, buf.get());
+        ssize_t ret = fs->read(fh, off, size, buf);
         if (ret >= 0)
-            fuse_reply_buf(req, buf.get(), ret);
+            fuse_reply_buf(req, buf, ret);
         else
             fuse_reply_err(req, -ret);
     }
@@ -358,6 +526,9 @@ private:
     static void
     ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode) {
         auto fs = get(req);
+        auto ticket = fs->admit(
+          req, Scheduler::META, ll_mkdir, parent, name, mode);
+        if (!ticket) return;
         const struct fuse_ctx* ctx = fuse_req_ctx(req);
 
         struct fuse_entry_param fe;
@@ -365,9 +536,7 @@ private:
 
         int ret = fs->mkdir(parent, name, mode, &fe.attr, ctx->uid, ctx->gid);
         if (ret == 0) {
-            fe.ino = fe.attr.st_ino;
-            fe.generation = 0;
-            fe.entry_timeout = 1.0;
+            fs->fill_entry(&fe);
             fuse_reply_entry(req, &fe);
         } else {
             fuse_reply_err(req, -ret);
@@ -376,6 +545,8 @@ private:
 
     static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name) {
         auto fs = get(req);
+        auto ticket = fs->admit(req, Scheduler::META, ll_rmdir, parent, name);
+        if (!ticket) return;
         const struct fuse_ctx* ctx = fuse_req_ctx(req);
 
         int ret = fs->rmdir(parent, name, ctx->uid, ctx->gid);
@@ -389,6 +560,9 @@ private:
       fuse_ino_t newparent,
       const char* newname) {
         auto fs = get(req);
+        auto ticket = fs->admit(
+          req, Scheduler::META, ll_rename, parent, name, newparent, newname);
+        if (!ticket) return;
         const struct fuse_ctx* ctx = fuse_req_ctx(req);
 
         int ret = fs->rename(
@@ -403,18 +577,23 @@ private:
       int to_set,
       struct fuse_file_info* fi) {
         auto fs = get(req);
+        auto ticket = fs->admit(
+          req, Scheduler::META, ll_setattr, ino, attr, to_set, fi);
+        if (!ticket) return;
         auto fh = fi ? reinterpret_cast<FileHandle*>(fi->fh) : nullptr;
         const struct fuse_ctx* ctx = fuse_req_ctx(req);
 
         int ret = fs->setattr(ino, fh, attr, to_set, ctx->uid, ctx->gid);
         if (ret == 0)
-            fuse_reply_attr(req, attr, 0);
+            fuse_reply_attr(req, attr, fs->attr_timeout_);
         else
             fuse_reply_err(req, -ret);
     }
 
     static void ll_readlink(fuse_req_t req, fuse_ino_t ino) {
         auto fs = get(req);
+        auto ticket = fs->admit(req, Scheduler::META, ll_readlink, ino);
+        if (!ticket) return;
         const struct fuse_ctx* ctx = fuse_req_ctx(req);
         char path[PATH_MAX + 1];
 
@@ -432,6 +611,9 @@ private:
     static void ll_symlink(
       fuse_req_t req, const char* link, fuse_ino_t parent, const char* name) {
         auto fs = get(req);
+        auto ticket = fs->admit(
+          req, Scheduler::META, ll_symlink, link, parent, name);
+        if (!ticket) return;
         const struct fuse_ctx* ctx = fuse_req_ctx(req);
 
         struct fuse_entry_param fe;
@@ -439,7 +621,7 @@ private:
 
         int ret = fs->symlink(link, parent, name, &fe.attr, ctx->uid, ctx->gid);
         if (ret == 0) {
-            fe.ino = fe.attr.st_ino;
+            fs->fill_entry(&fe);
             fuse_reply_entry(req, &fe);
         } else {
             fuse_reply_err(req, -ret);
@@ -458,6 +640,8 @@ private:
 
     static void ll_statfs(fuse_req_t req, fuse_ino_t ino) {
         auto fs = get(req);
+        auto ticket = fs->admit(req, Scheduler::META, ll_statfs, ino);
+        if (!ticket) return;
 
         struct statvfs stbuf;
         std::memset(&stbuf, 0, sizeof(stbuf));
@@ -475,6 +659,9 @@ private:
       fuse_ino_t newparent,
       const char* newname) {
         auto fs = get(req);
+        auto ticket = fs->admit(
+          req, Scheduler::META, ll_link, ino, newparent, newname);
+        if (!ticket) return;
         const struct fuse_ctx* ctx = fuse_req_ctx(req);
 
         struct fuse_entry_param fe;
@@ -483,7 +670,7 @@ private:
         int ret = fs->link(
           ino, newparent, newname, &fe.attr, ctx->uid, ctx->gid);
         if (ret == 0) {
-            fe.ino = fe.attr.st_ino;
+            fs->fill_entry(&fe);
             fuse_reply_entry(req, &fe);
         } else {
             fuse_reply_err(req, -ret);
@@ -492,6 +679,8 @@ private:
 
     static void ll_access(fuse_req_t req, fuse_ino_t ino, int mask) {
         auto fs = get(req);
+        auto ticket = fs->admit(req, Scheduler::META, ll_access, ino, mask);
+        if (!ticket) return;
         const struct fuse_ctx* ctx = fuse_req_ctx(req);
 
         int ret = fs->access(ino, mask, ctx->uid, ctx->gid);
@@ -505,6 +694,9 @@ private:
       mode_t mode,
       dev_t rdev) {
         auto fs = get(req);
+        auto ticket = fs->admit(
+          req, Scheduler::META, ll_mknod, parent, name, mode, rdev);
+        if (!ticket) return;
         const struct fuse_ctx* ctx = fuse_req_ctx(req);
 
         struct fuse_entry_param fe;
@@ -513,7 +705,7 @@ private:
         int ret = fs->mknod(
           parent, name, mode, rdev, &fe.attr, ctx->uid, ctx->gid);
         if (ret == 0) {
-            fe.ino = fe.attr.st_ino;
+            fs->fill_entry(&fe);
             fuse_reply_entry(req, &fe);
         } else {
             fuse_reply_err(req, -ret);
@@ -532,3 +724,127 @@ private:
 
     fuse_lowlevel_ops ops_;
 };
+
+/*
+ * An interface for file systems that are chosen at run time. Each operation
+ * is a virtual call, so implementations can be swapped behind one set of
+ * trampolines at the cost of an indirect call per request.
+ */
+class virtual_filesystem : public filesystem_base<virtual_filesystem> {
+public:
+    virtual ~virtual_filesystem() = default;
+
+    virtual void init(struct fuse_conn_info* conn) = 0;
+    virtual void destroy() = 0;
+    virtual int
+    lookup(fuse_ino_t parent_ino, std::string_view name, struct stat* st)
+      = 0;
+    virtual void forget(fuse_ino_t ino, long unsigned nlookup) = 0;
+    virtual int statfs(fuse_ino_t ino, struct statvfs* stbuf) = 0;
+
+    virtual int mknod(
+      fuse_ino_t parent_ino,
+      std::string_view name,
+      mode_t mode,
+      dev_t rdev,
+      struct stat* st,
+      uid_t uid,
+      gid_t gid)
+      = 0;
+
+    virtual int symlink(
+      std::string_view link,
+      fuse_ino_t parent_ino,
+      std::string_view name,
+      struct stat* st,
+      uid_t uid,
+      gid_t gid)
+      = 0;
+
+    virtual int link(
+      fuse_ino_t ino,
+      fuse_ino_t newparent_ino,
+      std::string_view newname,
+      struct stat* st,
+      uid_t uid,
+      gid_t gid)
+      = 0;
+
+    virtual int rename(
+      fuse_ino_t parent_ino,
+      std::string_view name,
+      fuse_ino_t newparent_ino,
+      std::string_view newname,
+      uid_t uid,
+      gid_t gid)
+      = 0;
+
+    virtual int
+    unlink(fuse_ino_t parent_ino, std::string_view name, uid_t uid, gid_t gid)
+      = 0;
+
+    virtual int access(fuse_ino_t ino, int mask, uid_t uid, gid_t gid) = 0;
+
+    virtual int getattr(fuse_ino_t ino, struct stat* st, uid_t uid, gid_t gid)
+      = 0;
+
+    virtual int setattr(
+      fuse_ino_t ino,
+      FileHandle* fh,
+      struct stat* attr,
+      int to_set,
+      uid_t uid,
+      gid_t gid)
+      = 0;
+
+    virtual ssize_t
+    readlink(fuse_ino_t ino, char* path, size_t maxlen, uid_t uid, gid_t gid)
+      = 0;
+
+    virtual int mkdir(
+      fuse_ino_t parent_ino,
+      std::string_view name,
+      mode_t mode,
+      struct stat* st,
+      uid_t uid,
+      gid_t gid)
+      = 0;
+
+    virtual int
+    opendir(fuse_ino_t ino, int flags, DirHandle** dhp, uid_t uid, gid_t gid)
+      = 0;
+
+    virtual ssize_t readdir(
+      fuse_req_t req, DirHandle* dh, char* buf, size_t bufsize, off_t off)
+      = 0;
+
+    virtual int
+    rmdir(fuse_ino_t parent_ino, std::string_view name, uid_t uid, gid_t gid)
+      = 0;
+
+    virtual void releasedir(fuse_ino_t ino, DirHandle* dh) = 0;
+
+    virtual int create(
+      fuse_ino_t parent_ino,
+      std::string_view name,
+      mode_t mode,
+      int flags,
+      struct stat* st,
+      FileHandle** fhp,
+      uid_t uid,
+      gid_t gid)
+      = 0;
+
+    virtual int
+    open(fuse_ino_t ino, int flags, FileHandle** fhp, uid_t uid, gid_t gid)
+      = 0;
+    virtual ssize_t
+    write_buf(FileHandle* fh, struct fuse_bufvec* bufv, off_t off)
+      = 0;
+    virtual ssize_t read(FileHandle* fh, off_t offset, size_t size, char* buf)
+      = 0;
+    virtual void release(fuse_ino_t ino, FileHandle* fh) = 0;
+
+    // fill in the open reply for a new file handle
+    virtual void open_reply(FileHandle* fh, struct fuse_file_info* fi) = 0;
+};
@@ -1,7 +1,16 @@
 #include <cassert>
+#include <csignal>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <iostream>
+#include <pthread.h>
+#include <queue>
 #include <stddef.h>
+#include <string_view>
+#include <thread>
+#include <vector>
 #if defined(__linux__)
 #include <linux/limits.h>
 #elif defined(__APPLE__)
@@ -11,144 +20,560 @@
 #include <fuse.h>
 #include <fuse_lowlevel.h>
 #include <fuse_opt.h>
+#include <zlib.h>
 
+#include "clock.h"
+#include "datapath.h"
+#include "dirindex.h"
+#include "epoch.h"
 #include "filesystem.h"
+#include "name.h"
+#include "quota.h"
+#include "ref.h"
 #include "spdlog/sinks/stdout_color_sinks.h"
 #include "spdlog/spdlog.h"
 
 struct Extent {
     Extent(size_t size)
       : size(size)
-      , buf(new char[size]) {}
+      , buf(new char[size])
+      , last_access(std::time(nullptr)) {}
 
-    size_t size;
+    // a compressed copy of an extent
+    Extent(size_t size, std::unique_ptr<char[]> zbuf, size_t zsize)
+      : size(size)
+      , zbuf(std::move(zbuf))
+      , zsize(zsize)
+      , last_access(std::time(nullptr)) {}
+
+    const size_t size;
     std::unique_ptr<char[]> buf;
+
+    // a cold extent has no buf and holds its contents compressed in zbuf.
+    // last_access records the last read or write and drives the hot to cold
+    // transition made by the background compressor. readers update it
+    // through the const view they are given.
+    std::unique_ptr<char[]> zbuf;
+    const size_t zsize = 0;
+    mutable std::atomic<time_t> last_access;
+
+    // set once the extent is reachable by readers. from then on only the
+    // bytes past the end of the file may be changed in place.
+    bool published = false;
+
+    bool cold() const { return !buf; }
+};
+
+/*
+ * File data is read without taking the file system lock. Writers publish an
+ * immutable FileData version after each update, and readers work from
+ * whichever version was current when they started. The extent list is shared
+ * by all versions published between two changes to the layout of the file.
+ * Replaced versions, lists and extents are reclaimed through the epoch domain.
+ */
+struct ExtentList {
+    std::vector<std::pair<off_t, const Extent*>> extents;
+};
+
+/*
+ * Small overwrites are appended to a write log rather than applied to the
+ * extents, which would mean a copy-on-write of each extent they touch.
+ * Records are never changed once written, so readers replay the records of
+ * their version over the extents in order, and later records win. The index
+ * is the writer's view of the newest data for each logged range and is what
+ * gets merged back into the extents.
+ *
+ * A log starts small. Growing it copies it into a bigger one, and the old
+ * one is retired like any other version that readers may be looking at.
+ */
+struct WriteLog {
+    struct Record {
+        off_t offset;
+        size_t size;
+        size_t pos;
+    };
+
+    WriteLog(size_t capacity, size_t max_records)
+      : buf(new char[capacity])
+      , capacity(capacity)
+      , records(new Record[max_records])
+      , max_records(max_records) {}
+
+    WriteLog(const WriteLog& log, size_t capacity, size_t max_records)
+      : WriteLog(capacity, max_records) {
+        assert(log.used <= capacity && log.count <= max_records);
+        std::memcpy(buf.get(), log.buf.get(), log.used);
+        std::memcpy(
+          records.get(), log.records.get(), log.count * sizeof(Record));
+        used = log.used;
+        count = log.count;
+        index = log.index;
+    }
+
+    bool full(size_t size) const {
+        return used + size > capacity || count == max_records;
+    }
+
+    bool overlaps(off_t offset, size_t size) const {
+        auto it = index.lower_bound(offset + size);
+        if (it == index.begin()) return false;
+        --it;
+        return it->first + (off_t)it->second.first > offset;
+    }
+
+    const std::unique_ptr<char[]> buf;
+    const size_t capacity;
+    size_t used = 0;
+
+    const std::unique_ptr<Record[]> records;
+    const size_t max_records;
+    size_t count = 0;
+
+    // reads that had to replay part of the log. past a threshold the log is
+    // merged so that reads stop paying for it.
+    mutable std::atomic<unsigned> read_hits{0};
+
+    // offset -> (size, pos) of non-overlapping ranges
+    std::map<off_t, std::pair<size_t, size_t>> index;
+};
+
+// a version is published by nearly every write, so they are pooled
+struct FileData {
+    off_t size;
+    const ExtentList* list;
+    const WriteLog* log = nullptr;
+    size_t log_records = 0;
+
+    static void* operator new(size_t size) {
+        return Pool<FileData>::allocate(size);
+    }
+    static void operator delete(void* p) { Pool<FileData>::deallocate(p); }
+};
+
+/*
+ * Inflate the first @len bytes of a cold extent into @dst. A read only needs
+ * the extent as far as it goes, and each thread keeps its inflate stream so
+ * that a cold read doesn't set one up and tear it down again.
+ */
+static void inflate_extent(const Extent& extent, char* dst, size_t len) {
+    assert(extent.cold() && len <= extent.size);
+
+    struct Stream {
+        Stream() {
+            [[maybe_unused]] int ret = inflateInit(&zs);
+            assert(ret == Z_OK);
+        }
+        ~Stream() { inflateEnd(&zs); }
+        z_stream zs = {};
+    };
+    thread_local Stream stream;
+    z_stream& zs = stream.zs;
+
+    inflateReset(&zs);
+    zs.next_in = (Bytef*)extent.zbuf.get();
+    zs.avail_in = extent.zsize;
+    zs.next_out = (Bytef*)dst;
+    zs.avail_out = len;
+    [[maybe_unused]] int ret = inflate(&zs, Z_SYNC_FLUSH);
+    assert((ret == Z_OK || ret == Z_STREAM_END) && zs.avail_out == 0);
+}
+
+/*
+ * Returns the length of the run of whole zero blocks at the start of @buf.
+ * Runs of zeros that would land in a hole are not given any storage.
+ */
+static size_t zero_blocks(const char* buf, size_t size) {
+    const size_t blksize = 4096;
+    size_t len = 0;
+    while (size - len >= blksize && is_zero(buf + len, blksize))
+        len += blksize;
+    return len;
+}
+
+/*
+ * Returns the length of the data at the start of @buf that comes before the
+ * first whole zero block, or @size if there isn't one.
+ */
+static size_t data_blocks(const char* buf, size_t size) {
+    const size_t blksize = 4096;
+    size_t len = 0;
+    while (size - len >= blksize && !is_zero(buf + len, blksize))
+        len += blksize;
+    return size - len < blksize ? size : len;
+}
+
+struct filesystem_opts {
+    size_t size;
+    bool debug;
+    unsigned compress_after;
+    size_t stream_threshold;
+    unsigned log_write_max;
+    double entry_timeout;
+    double attr_timeout;
+    double negative_timeout;
+    int cache;
+    size_t populate;
+    size_t max_write;
+    size_t max_read;
+    unsigned sched_slots;
+    unsigned sched_small;
+    unsigned sched_bulk;
+    size_t sched_bulk_size;
+    char* throttle;
+    char* quota;
+    int atime;
+    int lazytime;
+};
+
+// how open files use the kernel page cache
+enum {
+    CACHE_AUTO,   // dropped when the file is opened
+    CACHE_KEEP,   // kept across opens
+    CACHE_DIRECT, // not used
+};
+
+// when reads update the access time
+enum {
+    ATIME_STRICT,   // every read
+    ATIME_RELATIME, // the first read after a change, or a day later
+    ATIME_NOATIME,  // never
 };
 
 struct FileSystem;
 
-class Inode {
+/*
+ * The attributes of an inode, in the fields of struct stat that change under
+ * the file system lock, and in a third of its size. The names are those of
+ * struct stat so that they read the same, and st_mtim is a timespec so that
+ * st_mtime works as it does on a struct stat. The rest of a struct stat is
+ * filled in when it is replied with, see Inode::fill_stat.
+ */
+struct inode_attr {
+    mode_t st_mode = 0;
+    uint32_t st_nlink = 0;
+    uid_t st_uid = 0;
+    gid_t st_gid = 0;
+    off_t st_size = 0;
+    blkcnt_t st_blocks = 0;
+    struct timespec st_mtim = {0, 0};
+};
+
+/*
+ * Inodes are reference counted by Ref, and the inode table, directory
+ * entries and file handles each hold a reference. Code that only looks at an
+ * inode under the file system lock borrows a plain pointer.
+ *
+ * There are tens of millions of inodes in a large tree, so they are kept
+ * small: there is no vtable, since the type tag says which subclass to
+ * destroy, and each subclass is allocated from its own slabs.
+ */
+class Inode : public RefCounted<Inode> {
 public:
+    // the subclass, so that it can be found without rtti
+    enum inode_type : uint8_t { REGULAR, DIRECTORY, SYMLINK };
+
     Inode(
+      inode_type type,
       fuse_ino_t ino,
-      time_t time,
+      const struct timespec& time,
       uid_t uid,
-      gid_t gid,
-      blksize_t blksize,
-      mode_t mode,
-      FileSystem* fs)
-      : ino(ino)
-      , fs_(fs) {
-        memset(&i_st, 0, sizeof(i_st));
-        i_st.st_ino = ino;
-        i_st.st_atime = time;
-        i_st.st_mtime = time;
-        i_st.st_ctime = time;
+      gid_t gid)
+      : type(type)
+      , ino(ino)
+      , atime(to_ns(time))
+      , ctime(to_ns(time)) {
+        i_st.st_mtim = time;
         i_st.st_uid = uid;
         i_st.st_gid = gid;
-        i_st.st_blksize = blksize;
     }
 
-    virtual ~Inode() = 0;
+    // called by Ref when the last reference is dropped
+    static void destroy(const Inode* in);
 
+    const inode_type type;
     const fuse_ino_t ino;
 
-    struct stat i_st;
+    inode_attr i_st;
+
+    // the access and change times live outside of i_st, in nanoseconds,
+    // since reads look at them without holding the file system lock
+    std::atomic<int64_t> atime;
+    std::atomic<int64_t> ctime;
+
+    static constexpr blksize_t blksize = 4096;
+
+    void fill_stat(struct stat* st) const {
+        memset(st, 0, sizeof(*st));
+        st->st_ino = ino;
+        st->st_mode = i_st.st_mode;
+        st->st_nlink = i_st.st_nlink;
+        st->st_uid = i_st.st_uid;
+        st->st_gid = i_st.st_gid;
+        st->st_size = i_st.st_size;
+        st->st_blocks = i_st.st_blocks;
+        st->st_blksize = blksize;
+        st->st_atim = from_ns(atime.load(std::memory_order_relaxed));
+        st->st_mtim = i_st.st_mtim;
+        st->st_ctim = from_ns(ctime.load(std::memory_order_relaxed));
+    }
+
+    // the contents changed at @now, which changes the inode too
+    void modified(const struct timespec& now) {
+        i_st.st_mtim = now;
+        changed(now);
+    }
+
+    // the attributes changed at @now
+    void changed(const struct timespec& now) {
+        ctime.store(to_ns(now), std::memory_order_relaxed);
+    }
+
+    bool is_regular() const { return type == REGULAR; }
+    bool is_directory() const { return type == DIRECTORY; }
+    bool is_symlink() const { return type == SYMLINK; }
 
-    bool is_regular() const;
-    bool is_directory() const;
-    bool is_symlink() const;
+    // the inode as a T, or null if it is another type
+    template <typename T>
+    T* as() {
+        return type == T::type_tag ? static_cast<T*>(this) : nullptr;
+    }
 
     long int krefs = 0;
 
 protected:
-    FileSystem* fs_;
+    ~Inode() = default;
 };
 
 class RegInode : public Inode {
 public:
+    static constexpr inode_type type_tag = REGULAR;
+
     RegInode(
       fuse_ino_t ino,
-      time_t time,
+      const struct timespec& time,
       uid_t uid,
       gid_t gid,
-      blksize_t blksize,
       mode_t mode,
       FileSystem* fs)
-      : Inode(ino, time, uid, gid, blksize, mode, fs) {
+      : Inode(REGULAR, ino, time, uid, gid)
+      , data_(new FileData{0, new ExtentList})
+      , fs_(fs) {
         i_st.st_nlink = 1;
         i_st.st_mode = S_IFREG | mode;
     }
 
     ~RegInode();
 
-    std::map<off_t, Extent> extents_;
+    static void* operator new(size_t size) {
+        return Slab<RegInode>::allocate(size);
+    }
+    static void operator delete(void* p) { Slab<RegInode>::deallocate(p); }
+
+    typedef std::map<off_t, std::unique_ptr<Extent>> extent_map_t;
+
+    // the writer's view of the file, protected by the file system lock
+    extent_map_t extents_;
+
+    // what readers see. see FileSystem::publish
+    std::atomic<const FileData*> data_;
+    bool layout_changed_ = false;
+    std::vector<std::unique_ptr<Extent>> retired_;
+
+    // the space taken by the extents and logged bytes, charged to the owner
+    size_t space = 0;
+
+    std::unique_ptr<WriteLog> log_;
+    std::unique_ptr<WriteLog> retired_log_;
+
+    // opens for reading, and whether the kernel cache has been filled with
+    // the file since the kernel last looked it up
+    unsigned read_opens = 0;
+    bool populated = false;
+
+private:
+    FileSystem* fs_;
+};
+
+/*
+ * A directory listing serialized in the format that readdir returns. It is
+ * built the first time an open directory is listed and cached until it
+ * changes or the last handle to it is released, so listing an unchanged
+ * directory is a copy out of the cache.
+ */
+struct DirStream {
+    std::vector<char> buf;
+
+    // the readdir offset and buf position of each entry, in offset order
+    std::vector<std::pair<off_t, size_t>> entries;
+
+    size_t space() const {
+        return sizeof(*this) + buf.capacity()
+               + entries.capacity() * sizeof(entries[0]);
+    }
 };
 
 class DirInode : public Inode {
 public:
-    typedef std::map<std::string, std::shared_ptr<Inode>> dir_t;
+    static constexpr inode_type type_tag = DIRECTORY;
+
+    typedef DirIndex<Inode> dir_t;
+    typedef dir_t::Entry Dentry;
 
     DirInode(
       fuse_ino_t ino,
-      time_t time,
+      const struct timespec& time,
       uid_t uid,
       gid_t gid,
-      blksize_t blksize,
-      mode_t mode,
-      FileSystem* fs)
-      : Inode(ino, time, uid, gid, blksize, mode, fs) {
+      mode_t mode)
+      : Inode(DIRECTORY, ino, time, uid, gid) {
         i_st.st_nlink = 2;
         i_st.st_blocks = 1;
         i_st.st_mode = S_IFDIR | mode;
     }
 
+    static void* operator new(size_t size) {
+        return Slab<DirInode>::allocate(size);
+    }
+    static void operator delete(void* p) { Slab<DirInode>::deallocate(p); }
+
+    void add(std::string_view name, Inode* in);
+    void remove(Dentry* dentry);
+
+    /*
+     * Each entry gets the next readdir cookie when it is added, so a listing
+     * resumes with a seek in cookie order. Entries added or removed between
+     * two readdir calls don't shift the others, which are neither skipped nor
+     * returned twice. Offsets 0 and 1 are taken by "." and "..".
+     */
     dir_t dentries;
+
+    // dropped whenever an entry is added or removed, and once the directory
+    // isn't open anymore
+    std::shared_ptr<const DirStream> stream;
+    unsigned opens = 0;
 };
 
 class SymlinkInode : public Inode {
 public:
+    static constexpr inode_type type_tag = SYMLINK;
+
     SymlinkInode(
       fuse_ino_t ino,
-      time_t time,
+      const struct timespec& time,
       uid_t uid,
       gid_t gid,
-      blksize_t blksize,
-      const std::string& link,
-      FileSystem* fs)
-      : Inode(ino, time, uid, gid, blksize, 0, fs) {
+      std::string_view link)
+      : Inode(SYMLINK, ino, time, uid, gid)
+      , link(link) {
+        i_st.st_nlink = 1;
         i_st.st_mode = S_IFLNK;
         i_st.st_size = link.length();
-        this->link = link;
+    }
+
+    static void* operator new(size_t size) {
+        return Slab<SymlinkInode>::allocate(size);
+    }
+    static void operator delete(void* p) {
+        Slab<SymlinkInode>::deallocate(p);
     }
 
     std::string link;
 };
 
-class FileSystem : public filesystem_base {
+/*
+ * The inodes the kernel knows about, by inode number. Numbers are handed out
+ * in order and never reused, so the table is an array of them, in chunks
+ * that are freed once every inode in them is gone. That costs a pointer per
+ * inode instead of a hash table node.
+ */
+class InodeTable {
+public:
+    Inode* find(fuse_ino_t ino) const {
+        const size_t i = ino / chunk_size;
+        if (i >= chunks_.size() || !chunks_[i]) return nullptr;
+        return chunks_[i]->slots[ino % chunk_size].get();
+    }
+
+    // returns false if there already is an inode with the number
+    bool insert(Inode* in) {
+        const size_t i = in->ino / chunk_size;
+        if (i >= chunks_.size()) chunks_.resize(i + 1);
+        if (!chunks_[i]) chunks_[i] = std::make_unique<Chunk>();
+        Chunk& chunk = *chunks_[i];
+        Ref<Inode>& slot = chunk.slots[in->ino % chunk_size];
+        if (slot) return false;
+        slot = in;
+        chunk.used++;
+        size_++;
+        return true;
+    }
+
+    void erase(fuse_ino_t ino) {
+        auto& chunk = chunks_[ino / chunk_size];
+        assert(chunk && chunk->slots[ino % chunk_size]);
+        chunk->slots[ino % chunk_size].reset();
+        size_--;
+        if (--chunk->used == 0) chunk.reset();
+    }
+
+    size_t size() const { return size_; }
+
+    template <typename F>
+    void for_each(F f) const {
+        for (auto& chunk : chunks_) {
+            if (!chunk) continue;
+            for (auto& slot : chunk->slots)
+                if (slot) f(slot.get());
+        }
+    }
+
+    size_t bytes() const {
+        size_t ret = chunks_.capacity() * sizeof(chunks_[0]);
+        for (auto& chunk : chunks_)
+            if (chunk) ret += sizeof(Chunk);
+        return ret;
+    }
+
+private:
+    static constexpr size_t chunk_size = 4096;
+
+    struct Chunk {
+        Ref<Inode> slots[chunk_size];
+        unsigned used = 0;
+    };
+
+    std::vector<std::unique_ptr<Chunk>> chunks_;
+    size_t size_ = 0;
+};
+
+class FileSystem : public filesystem_base<FileSystem> {
 public:
-    FileSystem(size_t size, const std::shared_ptr<spdlog::logger>& log);
+    FileSystem(
+      const filesystem_opts& opts, const std::shared_ptr<spdlog::logger>& log);
 
     FileSystem(const FileSystem& other) = delete;
     FileSystem(FileSystem&& other) = delete;
-    ~FileSystem() = default;
+    ~FileSystem();
     FileSystem& operator=(const FileSystem& other) = delete;
     FileSystem& operator=(const FileSystem&& other) = delete;
 
 public:
+    void init(struct fuse_conn_info* conn);
     void destroy();
-    int lookup(fuse_ino_t parent_ino, const std::string& name, struct stat* st);
+    int lookup(fuse_ino_t parent_ino, std::string_view name, struct stat* st);
     void forget(fuse_ino_t ino, long unsigned nlookup);
     int statfs(fuse_ino_t ino, struct statvfs* stbuf);
 
     // TODO: get rid of this method
-    void free_space(Extent* extent);
+    void free_space(RegInode* in, const Extent* extent);
+    void drop_log(RegInode* in);
+    void retire_log(RegInode* in);
 
     // inode operations
 public:
     int mknod(
       fuse_ino_t parent_ino,
-      const std::string& name,
+      std::string_view name,
       mode_t mode,
       dev_t rdev,
       struct stat* st,
@@ -156,9 +581,9 @@ public:
       gid_t gid);
 
     int symlink(
-      const std::string& link,
+      std::string_view link,
       fuse_ino_t parent_ino,
-      const std::string& name,
+      std::string_view name,
       struct stat* st,
       uid_t uid,
       gid_t gid);
@@ -166,21 +591,21 @@ public:
     int link(
       fuse_ino_t ino,
       fuse_ino_t newparent_ino,
-      const std::string& newname,
+      std::string_view newname,
       struct stat* st,
       uid_t uid,
       gid_t gid);
 
     int rename(
       fuse_ino_t parent_ino,
-      const std::string& name,
+      std::string_view name,
       fuse_ino_t newparent_ino,
-      const std::string& newname,
+      std::string_view newname,
       uid_t uid,
       gid_t gid);
 
-    int unlink(
-      fuse_ino_t parent_ino, const std::string& name, uid_t uid, gid_t gid);
+    int
+    unlink(fuse_ino_t parent_ino, std::string_view name, uid_t uid, gid_t gid);
 
     int access(fuse_ino_t ino, int mask, uid_t uid, gid_t gid);
 
@@ -201,27 +626,28 @@ public:
 public:
     int mkdir(
       fuse_ino_t parent_ino,
-      const std::string& name,
+      std::string_view name,
       mode_t mode,
       struct stat* st,
       uid_t uid,
       gid_t gid);
 
-    int opendir(fuse_ino_t ino, int flags, uid_t uid, gid_t gid);
+    int
+    opendir(fuse_ino_t ino, int flags, DirHandle** dhp, uid_t uid, gid_t gid);
 
     ssize_t readdir(
-      fuse_req_t req, fuse_ino_t ino, char* buf, size_t bufsize, off_t off);
+      fuse_req_t req, DirHandle* dh, char* buf, size_t bufsize, off_t off);
 
     int
-    rmdir(fuse_ino_t parent_ino, const std::string& name, uid_t uid, gid_t gid);
+    rmdir(fuse_ino_t parent_ino, std::string_view name, uid_t uid, gid_t gid);
 
-    void releasedir(fuse_ino_t ino);
+    void releasedir(fuse_ino_t ino, DirHandle* dh);
 
     // file handle operation
 public:
     int create(
       fuse_ino_t parent_ino,
-      const std::string& name,
+      std::string_view name,
       mode_t mode,
       int flags,
       struct stat* st,
@@ -233,6 +659,7 @@ public:
     ssize_t write_buf(FileHandle* fh, struct fuse_bufvec* bufv, off_t off);
     ssize_t read(FileHandle* fh, off_t offset, size_t size, char* buf);
     void release(fuse_ino_t ino, FileHandle* fh);
+    void open_reply(FileHandle* fh, struct fuse_file_info* fi);
 
 private:
     std::mutex mutex_;
@@ -240,76 +667,269 @@ private:
 
     // inode management
 private:
-    void add_inode(const std::shared_ptr<Inode>& inode);
-    void get_inode(const std::shared_ptr<Inode>& inode);
+    void add_inode(Inode* inode);
+    void get_inode(Inode* inode);
     void put_inode(fuse_ino_t ino, long int dec);
 
-    std::shared_ptr<Inode> inode(fuse_ino_t ino) {
-        return inodes_.at(ino);
-        ;
+    // the inode table keeps these alive while the lock is held
+    Inode* inode(fuse_ino_t ino) {
+        auto in = inodes_.find(ino);
+        assert(in);
+        return in;
     }
 
-    std::shared_ptr<DirInode> dir_inode(fuse_ino_t ino) {
+    DirInode* dir_inode(fuse_ino_t ino) {
         auto in = inode(ino);
         assert(in->is_directory());
-        return std::static_pointer_cast<DirInode>(in);
+        return static_cast<DirInode*>(in);
     }
 
-    std::shared_ptr<SymlinkInode> symlink_inode(fuse_ino_t ino) {
+    SymlinkInode* symlink_inode(fuse_ino_t ino) {
         auto in = inode(ino);
         assert(in->is_symlink());
-        return std::static_pointer_cast<SymlinkInode>(in);
+        return static_cast<SymlinkInode*>(in);
     }
 
     std::atomic<fuse_ino_t> next_ino_;
-    std::unordered_map<fuse_ino_t, std::shared_ptr<Inode>> inodes_;
+
+    // declared before the inodes, which give back their space as they go
+    std::unique_ptr<Quota> quota_;
+    InodeTable inodes_;
 
     // helpers
 private:
-    // TODO: probably do not need to pass shared ptr here
-    ssize_t write(
-      const std::shared_ptr<RegInode>& in,
-      off_t offset,
-      size_t size,
-      const char* buf);
+    ssize_t read_file(RegInode* in, off_t offset, size_t size, char* buf);
 
-    int
-    access(const std::shared_ptr<Inode>& in, int mask, uid_t uid, gid_t gid);
+    ssize_t write(RegInode* in, off_t offset, size_t size, const char* buf);
 
-    int truncate(
-      const std::shared_ptr<RegInode>& in, off_t newsize, uid_t uid, gid_t gid);
+    int access(Inode* in, int mask, uid_t uid, gid_t gid);
+
+    std::shared_ptr<const DirStream> dir_stream(fuse_req_t req, DirInode* in);
+
+    int truncate(RegInode* in, off_t newsize, uid_t uid, gid_t gid);
 
     int allocate_space(
       RegInode* in,
-      std::map<off_t, Extent>::iterator* it,
+      RegInode::extent_map_t::iterator* it,
       off_t offset,
       size_t size,
       bool upper_bound);
 
+    int writable_extent(
+      RegInode* in,
+      RegInode::extent_map_t::iterator it,
+      off_t offset,
+      Extent** extentp);
+
+    RegInode::extent_map_t::iterator
+    retire_extent(RegInode* in, RegInode::extent_map_t::iterator it);
+
+    RegInode::extent_map_t::iterator punch_zeros(
+      RegInode* in,
+      RegInode::extent_map_t::iterator it,
+      size_t from,
+      size_t to);
+
+    void publish(RegInode* in);
+
+    void read_extents(
+      fuse_ino_t ino,
+      const ExtentList* list,
+      off_t offset,
+      size_t size,
+      char* buf,
+      time_t now) const;
+
+    // space and inodes, in total and per owner
+private:
+    int take_space(RegInode* in, size_t bytes);
+    void return_space(RegInode* in, size_t bytes);
+    int charge_inode(Inode* in);
+    void uncharge_inode(Inode* in);
+    int change_owner(Inode* in, uid_t uid, gid_t gid);
     uint64_t nfiles() const;
 
     struct statvfs stat;
     size_t avail_bytes_;
+
+    // linked inodes of each type
+    uint64_t inode_counts_[3] = {};
+
+    // cold extent compression
+private:
+    void compress_loop();
+    void compress_pass();
+    void stop_compressor();
+    void track_idle(RegInode* in, off_t offset, time_t stamp);
+
+    const time_t compress_after_;
+    bool compressor_stop_ = false;
+    std::condition_variable compressor_cv_;
+    std::thread compressor_;
+
+    // hot extents by when they were last seen to be used, earliest first.
+    // each one is looked at again once that is compress_after_ seconds ago.
+    // entries aren't removed when extents are, and are skipped if there is
+    // no longer a hot extent at the same place when they come up.
+    struct IdleExtent {
+        time_t stamp;
+        fuse_ino_t ino;
+        off_t offset;
+
+        bool operator>(const IdleExtent& other) const {
+            return stamp > other.stamp;
+        }
+    };
+    std::priority_queue<
+      IdleExtent,
+      std::vector<IdleExtent>,
+      std::greater<IdleExtent>>
+      idle_;
+
+    // cold extents that readers have used since the last pass
+    mutable std::mutex thaw_mutex_;
+    mutable std::vector<std::pair<fuse_ino_t, off_t>> thaw_;
+
+    // write logs
+private:
+    ssize_t
+    log_write(RegInode* in, off_t offset, size_t size, const char* buf);
+    ssize_t
+    write_unlogged(RegInode* in, off_t offset, size_t size, const char* buf);
+    int merge_log(RegInode* in);
+    bool grow_log(RegInode* in, size_t size);
+
+    // readers replay every record of the log that they see, so it is kept
+    // short and merged once it fills up.
+    static constexpr size_t log_min_capacity = 4096;
+    static constexpr size_t log_capacity = 1ULL << 20;
+    static constexpr size_t log_min_records = 16;
+    static constexpr size_t log_max_records = 256;
+    static constexpr unsigned log_read_merge = 16;
+
+    const size_t log_write_max_;
+
+    // kernel cache invalidation
+private:
+    void invalidate_inode(const Inode& in, off_t off = 0, off_t len = 0);
+    void store_inode(RegInode* in, off_t off, off_t len);
+    void notify_loop();
+    void stop_notifier();
+
+    struct Notification {
+        enum { INVAL_INODE, INVAL_ENTRY, STORE } op;
+        fuse_ino_t ino; // the parent for an entry
+        std::string name;
+        off_t off;
+        off_t len;
+        Ref<RegInode> in; // the source of stored data
+    };
+
+    std::deque<Notification> notifications_;
+    bool notifier_stop_ = false;
+    std::condition_variable notifier_cv_;
+    std::thread notifier_;
+
+    // per-tenant limits, reloaded on SIGUSR1 and reported on SIGUSR2
+private:
+    void load_throttle();
+    void load_quota();
+    void control_loop();
+    void stop_control();
+
+    std::string throttle_path_;
+    std::string quota_path_;
+    std::atomic<bool> control_stop_{false};
+    std::thread control_;
+
+    // lookup misses that the kernel may be caching
+private:
+    typedef std::chrono::steady_clock clock;
+    typedef std::pair<fuse_ino_t, std::string> entry_name_t;
+
+    void remember_negative(fuse_ino_t parent_ino, std::string_view name);
+    void invalidate_negative(fuse_ino_t parent_ino, std::string_view name);
+    void expire_negatives(clock::time_point now);
+
+    std::map<entry_name_t, clock::time_point> negatives_;
+    std::deque<std::pair<clock::time_point, entry_name_t>> negative_expiry_;
+
+    // kernel page cache policy
+private:
+    void cache_policy(RegInode* in, FileHandle* fh);
+    void direct_written(FileHandle* fh, off_t off, size_t size);
+
+    const int cache_mode_;
+    const size_t populate_max_;
+
+    // access times
+private:
+    void accessed(Inode* in, int64_t now);
+
+    const int atime_mode_;
+    const bool lazytime_;
+    static constexpr int64_t relatime_period = 24 * 3600 * 1000000000LL;
+
+    static constexpr unsigned populate_opens = 2;
+    static constexpr size_t store_chunk = 128 << 10;
 };
 
 struct FileHandle {
-    std::shared_ptr<RegInode> in;
+    Ref<RegInode> in;
     int flags;
 
-    FileHandle(std::shared_ptr<RegInode> in, int flags)
+    // reads and writes bypass the kernel page cache
+    bool direct_io = false;
+    bool keep_cache = false;
+
+    // the last read under lazytime, given to the inode on release
+    std::atomic<int64_t> atime{0};
+
+    FileHandle(Ref<RegInode> in, int flags)
       : in(in)
       , flags(flags) {}
+
+    static void* operator new(size_t size) {
+        return Pool<FileHandle>::allocate(size);
+    }
+    static void operator delete(void* p) { Pool<FileHandle>::deallocate(p); }
 };
 
-FileSystem::FileSystem(size_t size, const std::shared_ptr<spdlog::logger>& log)
-  : log_(log)
-  , next_ino_(FUSE_ROOT_ID) {
-    auto now = std::time(nullptr);
+/*
+ * An open directory lists the version of its stream that was current when
+ * the listing started, and picks up the current one when it is rewound.
+ */
+struct DirHandle {
+    Ref<DirInode> in;
+    std::shared_ptr<const DirStream> stream;
+
+    DirHandle(Ref<DirInode> in)
+      : in(in) {}
 
-    auto root = std::make_shared<DirInode>(
-      next_ino_++, now, getuid(), getgid(), 4096, 0755, this);
+    static void* operator new(size_t size) {
+        return Pool<DirHandle>::allocate(size);
+    }
+    static void operator delete(void* p) { Pool<DirHandle>::deallocate(p); }
+};
 
-    add_inode(root);
+FileSystem::FileSystem(
+  const filesystem_opts& opts, const std::shared_ptr<spdlog::logger>& log)
+  : log_(log)
+  , next_ino_(FUSE_ROOT_ID)
+  , compress_after_(opts.compress_after)
+  , log_write_max_(opts.log_write_max)
+  , cache_mode_(opts.cache)
+  , populate_max_(opts.populate)
+  , atime_mode_(opts.atime)
+  , lazytime_(opts.lazytime) {
+    const size_t size = opts.size;
+    auto now = coarse_now();
+
+    auto root = make_ref<DirInode>(
+      next_ino_++, now, getuid(), getgid(), 0755);
+
+    add_inode(root.get());
+    charge_inode(root.get());
 
     avail_bytes_ = size;
 
@@ -338,22 +958,92 @@ FileSystem::FileSystem(size_t size, const std::shared_ptr<spdlog::logger>& log)
         assert(0 == "oh yeh?");
     }
 
+    log_->info(
+      "using {} kernels for transfers of {} bytes or more",
+      datapath_kernel_name(),
+      datapath_stream_threshold);
+
     if (!next_ino_.is_lock_free()) {
         log_->warn("inode number allocation may not be lock free");
     }
+
+    // the control signals are blocked before any other thread starts, so
+    // that they all inherit the mask and only the control thread sees them
+    if (opts.throttle || opts.quota) {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+        sigaddset(&set, SIGUSR2);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+        if (opts.throttle) {
+            throttle_ = std::make_unique<Throttle>();
+            throttle_path_ = opts.throttle;
+            load_throttle();
+        }
+
+        if (opts.quota) {
+            quota_ = std::make_unique<Quota>();
+            quota_path_ = opts.quota;
+            load_quota();
+        }
+
+        control_ = std::thread(&FileSystem::control_loop, this);
+    }
+
+    if (compress_after_ > 0) {
+        log_->info("compressing extents idle for {} seconds", compress_after_);
+        compressor_ = std::thread(&FileSystem::compress_loop, this);
+    }
+
+    entry_timeout_ = opts.entry_timeout;
+    attr_timeout_ = opts.attr_timeout;
+    negative_timeout_ = opts.negative_timeout;
+    max_write_ = opts.max_write;
+    max_read_ = opts.max_read;
+
+    // by default bulk transfers get a quarter of the slots and small ones
+    // half, leaving the rest to metadata
+    if (opts.sched_slots) {
+        const unsigned slots = opts.sched_slots;
+        const unsigned small = opts.sched_small ? opts.sched_small : slots / 2;
+        const unsigned bulk = opts.sched_bulk ? opts.sched_bulk : slots / 4;
+        sched_ = std::make_unique<Scheduler>(slots, small, bulk);
+        bulk_size_ = opts.sched_bulk_size;
+        log_->info(
+          "scheduling {} requests at a time, {} small and {} bulk (>= {})",
+          slots,
+          small,
+          bulk,
+          bulk_size_);
+    }
+
+    log_->info(
+      "kernel caches entries for {}s, attributes for {}s, misses for {}s",
+      entry_timeout_,
+      attr_timeout_,
+      negative_timeout_);
+
+    notifier_ = std::thread(&FileSystem::notify_loop, this);
+}
+
+FileSystem::~FileSystem() {
+    stop_compressor();
+    stop_notifier();
+    stop_control();
+    epochs().drain();
 }
 
-void FileSystem::add_inode(const std::shared_ptr<Inode>& inode) {
+void FileSystem::add_inode(Inode* inode) {
     assert(inode->krefs == 0);
     inode->krefs++;
-    [[maybe_unused]] auto res = inodes_.emplace(inode->ino, inode);
-    assert(res.second); // check for duplicate ino
+    [[maybe_unused]] bool inserted = inodes_.insert(inode);
+    assert(inserted); // check for duplicate ino
 }
 
-void FileSystem::get_inode(const std::shared_ptr<Inode>& inode) {
+void FileSystem::get_inode(Inode* inode) {
     inode->krefs++;
-    auto res = inodes_.emplace(inode->ino, inode);
-    if (!res.second) {
+    if (!inodes_.insert(inode)) {
         assert(inode->krefs > 0);
     } else {
         assert(inode->krefs == 0);
@@ -361,25 +1051,69 @@ void FileSystem::get_inode(const std::shared_ptr<Inode>& inode) {
 }
 
 void FileSystem::put_inode(fuse_ino_t ino, long int dec) {
-    auto it = inodes_.find(ino);
-    assert(it != inodes_.end());
-    assert(it->second->krefs > 0);
-    it->second->krefs -= dec;
-    assert(it->second->krefs >= 0);
-    if (it->second->krefs == 0) {
-        inodes_.erase(it);
+    auto in = inode(ino);
+    assert(in->krefs > 0);
+    in->krefs -= dec;
+    assert(in->krefs >= 0);
+    if (in->krefs == 0) {
+        // the kernel drops its cached pages along with the inode
+        if (auto reg_in = in->as<RegInode>()) reg_in->populated = false;
+        inodes_.erase(ino);
     }
 }
 
 uint64_t FileSystem::nfiles() const {
-    uint64_t ret = 0;
-    for (auto it = inodes_.begin(); it != inodes_.end(); it++)
-        if (it->second->i_st.st_mode & S_IFREG) ret++;
-    return ret;
+    return inode_counts_[Inode::REGULAR] + inode_counts_[Inode::DIRECTORY]
+           + inode_counts_[Inode::SYMLINK];
+}
+
+void FileSystem::init(struct fuse_conn_info* conn) {
+    log_->info(
+      "requesting writes of up to {} bytes, reads of up to {} bytes",
+      conn->max_write,
+      conn->max_readahead);
+
+#ifdef FUSE_CAP_CACHE_SYMLINKS
+    // symlinks can't be changed, only replaced, so their targets can be
+    // cached for as long as the kernel holds on to them.
+    if (conn->capable & FUSE_CAP_CACHE_SYMLINKS)
+        conn->want |= FUSE_CAP_CACHE_SYMLINKS;
+#endif
 }
 
 void FileSystem::destroy() {
     log_->info("shutting down file system");
+    log_->info(
+      "allocated {} file handles and {} directory handles, {} from the heap",
+      Pool<FileHandle>::allocs(),
+      Pool<DirHandle>::allocs(),
+      Pool<FileHandle>::heap_allocs() + Pool<DirHandle>::heap_allocs());
+    log_->info(
+      "published {} file versions, {} from the heap",
+      Pool<FileData>::allocs(),
+      Pool<FileData>::heap_allocs());
+    log_->info("grew reply buffers {} times", Scratch::heap_allocs());
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        log_->info(
+          "{} inodes in {} bytes of slabs, table {} bytes, {} long names in "
+          "{} bytes",
+          Slab<RegInode>::in_use() + Slab<DirInode>::in_use()
+            + Slab<SymlinkInode>::in_use(),
+          Slab<RegInode>::bytes() + Slab<DirInode>::bytes()
+            + Slab<SymlinkInode>::bytes(),
+          inodes_.bytes(),
+          Name::interned_count(),
+          Name::interned_bytes());
+        log_->info(
+          "{} files, {} directories and {} symlinks linked",
+          inode_counts_[Inode::REGULAR],
+          inode_counts_[Inode::DIRECTORY],
+          inode_counts_[Inode::SYMLINK]);
+    }
+    stop_compressor();
+    stop_notifier();
+    stop_control();
     // note that according to the fuse documentation when the file system is
     // unmounted and shutdown all of the inode references implicitly drop to
     // zero.
@@ -387,7 +1121,7 @@ void FileSystem::destroy() {
 
 int FileSystem::create(
   fuse_ino_t parent_ino,
-  const std::string& name,
+  std::string_view name,
   mode_t mode,
   int flags,
   struct stat* st,
@@ -408,17 +1142,16 @@ int FileSystem::create(
         return -ENAMETOOLONG;
     }
 
-    auto now = std::time(nullptr);
+    auto now = coarse_now();
 
-    auto in = std::make_shared<RegInode>(
-      next_ino_++, now, uid, gid, 4096, S_IFREG | mode, this);
+    auto in = make_ref<RegInode>(
+      next_ino_++, now, uid, gid, S_IFREG | mode, this);
     auto fh = std::make_unique<FileHandle>(in, flags);
 
     std::lock_guard<std::mutex> l(mutex_);
 
     auto parent_in = dir_inode(parent_ino);
-    DirInode::dir_t& children = parent_in->dentries;
-    if (children.find(name) != children.end()) {
+    if (parent_in->dentries.find(name)) {
         log_->debug("create name {} already exists", name);
         return -EEXIST;
     }
@@ -429,13 +1162,17 @@ int FileSystem::create(
         return ret;
     }
 
-    children[name] = in;
-    add_inode(in);
+    ret = charge_inode(in.get());
+    if (ret) return ret;
+
+    parent_in->add(name, in.get());
+    add_inode(in.get());
+    invalidate_negative(parent_ino, name);
 
-    parent_in->i_st.st_ctime = now;
-    parent_in->i_st.st_mtime = now;
+    parent_in->modified(now);
 
-    *st = in->i_st;
+    in->fill_stat(st);
+    cache_policy(in.get(), fh.get());
     *fhp = fh.release();
 
     log_->debug("created name {} with ino {}", name, in->ino);
@@ -448,23 +1185,23 @@ int FileSystem::getattr(fuse_ino_t ino, struct stat* st, uid_t uid, gid_t gid) {
 
     auto in = inode(ino);
 
-    *st = in->i_st;
+    in->fill_stat(st);
 
     return 0;
 }
 
 int FileSystem::unlink(
-  fuse_ino_t parent_ino, const std::string& name, uid_t uid, gid_t gid) {
+  fuse_ino_t parent_ino, std::string_view name, uid_t uid, gid_t gid) {
     std::lock_guard<std::mutex> l(mutex_);
 
     auto parent_in = dir_inode(parent_ino);
-    DirInode::dir_t::const_iterator it = parent_in->dentries.find(name);
-    if (it == parent_in->dentries.end()) return -ENOENT;
+    DirInode::Dentry* dentry = parent_in->dentries.find(name);
+    if (!dentry) return -ENOENT;
 
     int ret = access(parent_in, W_OK, uid, gid);
     if (ret) return ret;
 
-    auto in = it->second;
+    auto in = dentry->inode;
 
     // see unlink(2): EISDIR may be another case
     if (in->is_directory()) return -EPERM;
@@ -474,36 +1211,36 @@ int FileSystem::unlink(
             return -EPERM;
     }
 
-    auto now = std::time(nullptr);
+    auto now = coarse_now();
 
-    in->i_st.st_ctime = now;
-    in->i_st.st_nlink--;
+    in->changed(now);
+    if (--in->i_st.st_nlink == 0) uncharge_inode(in.get());
 
-    parent_in->i_st.st_ctime = now;
-    parent_in->i_st.st_mtime = now;
-    parent_in->dentries.erase(it);
+    parent_in->modified(now);
+    parent_in->remove(dentry);
 
     return 0;
 }
 
 int FileSystem::lookup(
-  fuse_ino_t parent_ino, const std::string& name, struct stat* st) {
+  fuse_ino_t parent_ino, std::string_view name, struct stat* st) {
     std::lock_guard<std::mutex> l(mutex_);
 
     // FIXME: should this be -ENOTDIR or -ENOENT in some cases?
     auto parent_in = dir_inode(parent_ino);
-    DirInode::dir_t::const_iterator it = parent_in->dentries.find(name);
-    if (it == parent_in->dentries.end()) {
+    DirInode::Dentry* dentry = parent_in->dentries.find(name);
+    if (!dentry) {
         log_->debug("lookup parent {} name {} not found", parent_ino, name);
+        if (negative_timeout_ > 0) remember_negative(parent_ino, name);
         return -ENOENT;
     }
 
-    auto in = it->second;
+    Inode* in = dentry->inode.get();
 
     // bump kernel inode cache reference count
     get_inode(in);
 
-    *st = in->i_st;
+    in->fill_stat(st);
 
     log_->debug("lookup parent {} name {} found {}", parent_ino, name, in->ino);
 
@@ -534,9 +1271,8 @@ int FileSystem::open(
 
     std::lock_guard<std::mutex> l(mutex_);
 
-    auto generic_in = inode(ino);
-    auto in = std::dynamic_pointer_cast<RegInode>(generic_in);
-    assert(in->is_regular());
+    auto in = inode(ino)->as<RegInode>();
+    assert(in);
     auto fh = std::make_unique<FileHandle>(in, flags);
 
     int ret = access(in, mode, uid, gid);
@@ -553,6 +1289,7 @@ int FileSystem::open(
 
     if (flags & O_TRUNC) {
         ret = truncate(in, 0, uid, gid);
+        publish(in);
         if (ret) {
             log_->debug(
               "open ino {} flags {} uid {} gid {} ret {}",
@@ -563,11 +1300,12 @@ int FileSystem::open(
               ret);
             return ret;
         }
-        auto now = std::time(nullptr);
-        in->i_st.st_mtime = now;
-        in->i_st.st_ctime = now;
+        auto now = coarse_now();
+        in->modified(now);
     }
 
+    cache_policy(in, fh.get());
+
     *fhp = fh.release();
 
     log_->debug(
@@ -576,9 +1314,20 @@ int FileSystem::open(
     return 0;
 }
 
+void FileSystem::open_reply(FileHandle* fh, struct fuse_file_info* fi) {
+    fi->direct_io = fh->direct_io;
+    fi->keep_cache = fh->keep_cache;
+}
+
 void FileSystem::release(fuse_ino_t ino, FileHandle* fh) {
     log_->debug("release ino {} fh {}", ino, (void*)fh);
     assert(fh);
+    // dropping the last reference to an unlinked file frees its space
+    std::lock_guard<std::mutex> l(mutex_);
+
+    if (const int64_t atime = fh->atime.load(std::memory_order_relaxed))
+        accessed(fh->in.get(), atime);
+
     delete fh;
 }
 
@@ -592,11 +1341,10 @@ ssize_t
 FileSystem::write_buf(FileHandle* fh, struct fuse_bufvec* bufv, off_t off) {
     std::lock_guard<std::mutex> l(mutex_);
 
-    auto gen_in = fh->in;
-    assert(gen_in->is_regular());
-    auto in = std::dynamic_pointer_cast<RegInode>(gen_in);
+    RegInode* in = fh->in.get();
 
     size_t written = 0;
+    ssize_t ret = 0;
 
     for (size_t i = bufv->idx; i < bufv->count; i++) {
         struct fuse_buf* buf = bufv->buf + i;
@@ -605,43 +1353,122 @@ FileSystem::write_buf(FileHandle* fh, struct fuse_bufvec* bufv, off_t off) {
         assert(!(buf->flags & FUSE_BUF_FD_RETRY));
         assert(!(buf->flags & FUSE_BUF_FD_SEEK));
 
-        ssize_t ret;
-        if (i == bufv->idx) {
-            ret = write(
-              in, off, buf->size - bufv->off, (char*)buf->mem + bufv->off);
-            if (ret < 0) return ret;
-            assert(buf->size > bufv->off);
-            if (ret < (ssize_t)(buf->size - bufv->off)) return written;
-        } else {
-            ret = write(in, off, buf->size, (char*)buf->mem);
-            if (ret < 0) return ret;
-            if (ret < (ssize_t)buf->size) return written;
-        }
+        const size_t skip = i == bufv->idx ? bufv->off : 0;
+        assert(buf->size > skip);
+
+        const size_t size = buf->size - skip;
+        const char* mem = (const char*)buf->mem + skip;
+
+        // small overwrites are logged. anything else goes to the extents.
+        if (size <= log_write_max_ && (off_t)(off + size) <= in->i_st.st_size)
+            ret = log_write(in, off, size, mem);
+        else
+            ret = write_unlogged(in, off, size, mem);
+        if (ret < 0 || ret < (ssize_t)size) break;
+
         off += ret;
         written += ret;
     }
 
-    return written;
+    // a failed write may still have changed the file
+    publish(in);
+
+    if (written) direct_written(fh, off - written, written);
+
+    return ret < 0 ? ret : written;
 }
 
 ssize_t FileSystem::read(FileHandle* fh, off_t offset, size_t size, char* buf) {
-    std::lock_guard<std::mutex> l(mutex_);
+    if (atime_mode_ != ATIME_NOATIME) {
+        const int64_t now = to_ns(coarse_now());
+        if (!lazytime_)
+            accessed(fh->in.get(), now);
+        else if (fh->atime.load(std::memory_order_relaxed) < now)
+            fh->atime.store(now, std::memory_order_relaxed);
+    }
+    return read_file(fh->in.get(), offset, size, buf);
+}
+
+/*
+ * Record a read of @in at @now. Reads don't take the file system lock, and
+ * most of them don't write to the inode either: strictatime only stores a
+ * newer time, which the coarse clock gives once a tick, and relatime only
+ * once the file has changed since the last recorded read, or a day after it.
+ * Every change to a file moves its ctime, so that is what relatime compares
+ * with. Under lazytime the reads of an open file are recorded in its handle
+ * and reach the inode when it is closed.
+ */
+void FileSystem::accessed(Inode* in, int64_t now) {
+    if (atime_mode_ == ATIME_NOATIME) return;
+    const int64_t atime = in->atime.load(std::memory_order_relaxed);
+    if (atime >= now) return;
+    if (
+      atime_mode_ == ATIME_RELATIME
+      && atime > in->ctime.load(std::memory_order_relaxed)
+      && now - atime < relatime_period)
+        return;
+    in->atime.store(now, std::memory_order_relaxed);
+}
 
-    std::shared_ptr<RegInode> in = std::dynamic_pointer_cast<RegInode>(fh->in);
+ssize_t FileSystem::read_file(
+  RegInode* in, off_t offset, size_t size, char* buf) {
+    const time_t now = coarse_now().tv_sec;
 
-    in->i_st.st_atime = std::time(nullptr);
+    // pin the version of the file that is current right now. writers never
+    // modify anything that a published version can see, so the read doesn't
+    // need the file system lock and never waits on a writer.
+    EpochGuard guard(epochs());
+    const FileData* data = in->data_.load();
 
     // reads that start past eof return nothing
-    if (offset >= in->i_st.st_size || size == 0) return 0;
+    if (offset >= data->size || size == 0) return 0;
 
     // clip the read so that it doesn't pass eof
-    size_t left;
-    if ((off_t)(offset + size) > in->i_st.st_size)
-        left = in->i_st.st_size - offset;
-    else
-        left = size;
+    if ((off_t)(offset + size) > data->size) size = data->size - offset;
+
+    read_extents(in->ino, data->list, offset, size, buf, now);
+
+    const WriteLog* log = data->log;
+    if (!log) return size;
+
+    // replay the write log over the extents
+    bool hit = false;
+    const off_t end = offset + size;
+    for (size_t i = 0; i < data->log_records; i++) {
+        const auto& rec = log->records[i];
+        const off_t from = std::max(offset, rec.offset);
+        const off_t to = std::min(end, (off_t)(rec.offset + rec.size));
+        if (from >= to) continue;
+        std::memcpy(
+          buf + (from - offset),
+          log->buf.get() + rec.pos + (from - rec.offset),
+          to - from);
+        hit = true;
+    }
 
-    const size_t new_size = left;
+    // merge a log that keeps getting read, unless a writer is busy in which
+    // case a later read will try again.
+    if (hit && ++log->read_hits >= log_read_merge) {
+        std::unique_lock<std::mutex> l(mutex_, std::try_to_lock);
+        if (l.owns_lock() && in->log_.get() == log) {
+            merge_log(in);
+            publish(in);
+        }
+    }
+
+    return size;
+}
+
+void FileSystem::read_extents(
+  fuse_ino_t ino,
+  const ExtentList* list,
+  off_t offset,
+  size_t size,
+  char* buf,
+  time_t now) const {
+    const auto& extents = list->extents;
+    const bool stream = datapath_stream(size);
+    size_t left = size;
     char* dst = buf;
 
     /*
@@ -655,17 +1482,23 @@ ssize_t FileSystem::read(FileHandle* fh, off_t offset, size_t size, char* buf) {
      * 1) it == begin(): can't move backward
      * 2) it == end() / other: <= case described above
      */
-    auto it = in->extents_.upper_bound(offset);
-    if (it != in->extents_.begin()) { // not empty
-        assert(!in->extents_.empty());
+    auto it = std::upper_bound(
+      extents.begin(),
+      extents.end(),
+      offset,
+      [](off_t offset, const std::pair<off_t, const Extent*>& extent) {
+          return offset < extent.first;
+      });
+    if (it != extents.begin()) { // not empty
+        assert(!extents.empty());
         --it;
-    } else if (it == in->extents_.end()) { // empty
-        assert(in->extents_.empty());
-        memset(dst, 0, new_size);
-        return new_size;
+    } else if (it == extents.end()) { // empty
+        assert(extents.empty());
+        data_zero(dst, size, stream);
+        return;
     }
 
-    assert(it != in->extents_.end());
+    assert(it != extents.end());
     off_t seg_offset = it->first;
 
     while (left) {
@@ -676,14 +1509,10 @@ ssize_t FileSystem::read(FileHandle* fh, off_t offset, size_t size, char* buf) {
         // beginning of the segment or until we've completed the read.
         if (offset < seg_offset) {
             done = std::min(left, (size_t)(seg_offset - offset));
-            memset(dst, 0, done);
+            data_zero(dst, done, stream);
         } else {
-            const auto& extent = it->second;
-            off_t seg_end_offset = seg_offset + extent.size;
-
-            // fixme: there may be a case here where the end of file lands
-            // inside an allocated extent, but logically it shoudl be returning
-            // zeros
+            const Extent* extent = it->second;
+            off_t seg_end_offset = seg_offset + extent->size;
 
             // read starts within the current segment. return valid data up
             // until the end of the segment or until we've completed the read.
@@ -691,9 +1520,37 @@ ssize_t FileSystem::read(FileHandle* fh, off_t offset, size_t size, char* buf) {
                 done = std::min(left, (size_t)(seg_end_offset - offset));
 
                 size_t blkoff = offset - seg_offset;
-                std::memcpy(dst, extent.buf.get() + blkoff, done);
-
-            } else if (++it == in->extents_.end()) {
+                // only once a second, so that reads of a hot extent don't
+                // keep writing to it. a cold extent that is read is handed
+                // to the compressor to be brought back.
+                if (
+                  extent->last_access.load(std::memory_order_relaxed) != now) {
+                    extent->last_access.store(now, std::memory_order_relaxed);
+                    if (extent->cold()) {
+                        std::lock_guard<std::mutex> l(thaw_mutex_);
+                        thaw_.emplace_back(ino, seg_offset);
+                    }
+                }
+                if (extent->cold()) {
+                    // the compressor brings the extent back to hot if it
+                    // keeps getting read. until then it is inflated up to
+                    // the end of the read, straight into the reply if the
+                    // read starts at the extent, or else into a buffer that
+                    // the thread keeps.
+                    const size_t len = blkoff + done;
+                    if (!blkoff) {
+                        inflate_extent(*extent, dst, len);
+                    } else {
+                        thread_local std::vector<char> cold;
+                        if (cold.size() < len) cold.resize(len);
+                        inflate_extent(*extent, cold.data(), len);
+                        data_copy(dst, cold.data() + blkoff, done, stream);
+                    }
+                } else {
+                    data_copy(dst, extent->buf.get() + blkoff, done, stream);
+                }
+
+            } else if (++it == extents.end()) {
                 seg_offset = offset + left;
                 assert(offset < seg_offset);
                 // assert that we'll be done
@@ -707,13 +1564,11 @@ ssize_t FileSystem::read(FileHandle* fh, off_t offset, size_t size, char* buf) {
         offset += done;
         left -= done;
     }
-
-    return new_size;
 }
 
 int FileSystem::mkdir(
   fuse_ino_t parent_ino,
-  const std::string& name,
+  std::string_view name,
   mode_t mode,
   struct stat* st,
   uid_t uid,
@@ -731,16 +1586,14 @@ int FileSystem::mkdir(
         return ret;
     }
 
-    auto now = std::time(nullptr);
+    auto now = coarse_now();
 
-    auto in = std::make_shared<DirInode>(
-      next_ino_++, now, uid, gid, 4096, mode, this);
+    auto in = make_ref<DirInode>(next_ino_++, now, uid, gid, mode);
 
     std::lock_guard<std::mutex> l(mutex_);
 
     auto parent_in = dir_inode(parent_ino);
-    DirInode::dir_t& children = parent_in->dentries;
-    if (children.find(name) != children.end()) {
+    if (parent_in->dentries.find(name)) {
         const int ret = -EEXIST;
         log_->debug(
           "mkdir parent {} name {} mode {} uid {} gid {} ret {}",
@@ -766,14 +1619,17 @@ int FileSystem::mkdir(
         return ret;
     }
 
-    children[name] = in;
-    add_inode(in);
+    ret = charge_inode(in.get());
+    if (ret) return ret;
+
+    parent_in->add(name, in.get());
+    add_inode(in.get());
+    invalidate_negative(parent_ino, name);
 
-    parent_in->i_st.st_ctime = now;
-    parent_in->i_st.st_mtime = now;
+    parent_in->modified(now);
     parent_in->i_st.st_nlink++;
 
-    *st = in->i_st;
+    in->fill_stat(st);
 
     log_->debug(
       "mkdir parent {} name {} mode {} uid {} gid {} ret {}",
@@ -788,13 +1644,12 @@ int FileSystem::mkdir(
 }
 
 int FileSystem::rmdir(
-  fuse_ino_t parent_ino, const std::string& name, uid_t uid, gid_t gid) {
+  fuse_ino_t parent_ino, std::string_view name, uid_t uid, gid_t gid) {
     std::lock_guard<std::mutex> l(mutex_);
 
     auto parent_in = dir_inode(parent_ino);
-    DirInode::dir_t& children = parent_in->dentries;
-    DirInode::dir_t::const_iterator it = children.find(name);
-    if (it == children.end()) {
+    DirInode::Dentry* dentry = parent_in->dentries.find(name);
+    if (!dentry) {
         log_->debug(
           "rmdir ENOENT parent {} name {} uid {} gid {}",
           parent_ino,
@@ -804,7 +1659,7 @@ int FileSystem::rmdir(
         return -ENOENT;
     }
 
-    if (!it->second->is_directory()) {
+    if (!dentry->inode->is_directory()) {
         log_->debug(
           "rmdir ENOTDIR parent {} name {} uid {} gid {}",
           parent_ino,
@@ -814,7 +1669,7 @@ int FileSystem::rmdir(
         return -ENOTDIR;
     }
 
-    auto in = std::static_pointer_cast<DirInode>(it->second);
+    auto in = static_cast<DirInode*>(dentry->inode.get());
 
     if (in->dentries.size()) {
         log_->debug(
@@ -838,11 +1693,14 @@ int FileSystem::rmdir(
         }
     }
 
-    auto now = std::time(nullptr);
+    auto now = coarse_now();
 
-    parent_in->i_st.st_mtime = now;
-    parent_in->i_st.st_ctime = now;
-    parent_in->dentries.erase(it);
+    // the directory may still be open, and reports no links once it's gone
+    in->i_st.st_nlink = 0;
+    uncharge_inode(in);
+
+    parent_in->modified(now);
+    parent_in->remove(dentry);
     parent_in->i_st.st_nlink--;
 
     log_->debug(
@@ -853,9 +1711,9 @@ int FileSystem::rmdir(
 
 int FileSystem::rename(
   fuse_ino_t parent_ino,
-  const std::string& name,
+  std::string_view name,
   fuse_ino_t newparent_ino,
-  const std::string& newname,
+  std::string_view newname,
   uid_t uid,
   gid_t gid) {
     if (name.length() > NAME_MAX || newname.length() > NAME_MAX)
@@ -865,24 +1723,25 @@ int FileSystem::rename(
 
     // old
     auto parent_in = dir_inode(parent_ino);
-    DirInode::dir_t& parent_children = parent_in->dentries;
-    DirInode::dir_t::const_iterator old_it = parent_children.find(name);
-    if (old_it == parent_children.end()) return -ENOENT;
+    DirInode::Dentry* old_dentry = parent_in->dentries.find(name);
+    if (!old_dentry) return -ENOENT;
 
-    auto old_in = old_it->second;
+    auto old_in = old_dentry->inode;
     assert(old_in);
 
     // new
     auto newparent_in = dir_inode(newparent_ino);
-    DirInode::dir_t& newparent_children = newparent_in->dentries;
-    DirInode::dir_t::const_iterator new_it = newparent_children.find(newname);
+    DirInode::Dentry* new_dentry = newparent_in->dentries.find(newname);
 
-    std::shared_ptr<Inode> new_in = NULL;
-    if (new_it != newparent_children.end()) {
-        new_in = new_it->second;
+    Ref<Inode> new_in;
+    if (new_dentry) {
+        new_in = new_dentry->inode;
         assert(new_in);
     }
 
+    // see rename(2): links to the same file are left alone
+    if (new_in.get() == old_in.get()) return 0;
+
     /*
      * EACCES write permission is denied for the directory containing oldpath or
      * newpath,
@@ -901,7 +1760,7 @@ int FileSystem::rename(
     if (ret) return ret;
 
     if (old_in->i_st.st_mode & S_IFDIR) {
-        ret = access(old_in, W_OK, uid, gid);
+        ret = access(old_in.get(), W_OK, uid, gid);
         if (ret) return ret;
     }
 
@@ -935,22 +1794,35 @@ int FileSystem::rename(
     if (new_in) {
         if (old_in->i_st.st_mode & S_IFDIR) {
             if (new_in->i_st.st_mode & S_IFDIR) {
-                DirInode::dir_t& new_children
-                  = std::static_pointer_cast<DirInode>(new_in)->dentries;
-                if (new_children.size()) return -ENOTEMPTY;
+                auto new_dir_in = static_cast<DirInode*>(new_in.get());
+                if (new_dir_in->dentries.size()) return -ENOTEMPTY;
             } else
                 return -ENOTDIR;
         } else {
             if (new_in->i_st.st_mode & S_IFDIR) return -EISDIR;
         }
 
-        newparent_children.erase(new_it);
+        newparent_in->remove(new_dentry);
+
+        // the replaced inode may be cached under other names
+        new_in->changed(coarse_now());
+        if (new_in->is_directory())
+            new_in->i_st.st_nlink = 0;
+        else
+            new_in->i_st.st_nlink--;
+        if (new_in->i_st.st_nlink == 0) uncharge_inode(new_in.get());
+        invalidate_inode(*new_in);
     }
 
-    old_in->i_st.st_ctime = std::time(nullptr);
+    old_in->changed(coarse_now());
 
-    newparent_children[newname] = old_it->second;
-    parent_children.erase(old_it);
+    // the entry gets a new cookie. a listing in progress may return it
+    // under both names, but that is allowed for entries renamed during it.
+    // removing the replaced entry may have moved the old one.
+    if (new_in) old_dentry = parent_in->dentries.find(name);
+    parent_in->remove(old_dentry);
+    newparent_in->add(newname, old_in.get());
+    invalidate_negative(newparent_ino, newname);
 
     return 0;
 }
@@ -967,7 +1839,7 @@ int FileSystem::setattr(
 
     auto in = inode(ino);
 
-    auto now = std::time(nullptr);
+    auto now = coarse_now();
 
     if (to_set & FUSE_SET_ATTR_MODE) {
         if (uid && in->i_st.st_uid != uid) return -EPERM;
@@ -995,9 +1867,11 @@ int FileSystem::setattr(
         if (uid && (to_set & FUSE_SET_ATTR_GID) && (uid != in->i_st.st_uid))
             return -EPERM;
 
-        if (to_set & FUSE_SET_ATTR_UID) in->i_st.st_uid = attr->st_uid;
-
-        if (to_set & FUSE_SET_ATTR_GID) in->i_st.st_gid = attr->st_gid;
+        int ret = change_owner(
+          in,
+          to_set & FUSE_SET_ATTR_UID ? attr->st_uid : in->i_st.st_uid,
+          to_set & FUSE_SET_ATTR_GID ? attr->st_gid : in->i_st.st_gid);
+        if (ret) return ret;
     }
 
     if (to_set & (FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_ATIME)) {
@@ -1005,25 +1879,25 @@ int FileSystem::setattr(
 
 #ifdef FUSE_SET_ATTR_MTIME_NOW
         if (to_set & FUSE_SET_ATTR_MTIME_NOW)
-            in->i_st.st_mtime = std::time(nullptr);
+            in->i_st.st_mtim = now;
         else
 #endif
           if (to_set & FUSE_SET_ATTR_MTIME)
-            in->i_st.st_mtime = attr->st_mtime;
+            in->i_st.st_mtim = attr->st_mtim;
 
 #ifdef FUSE_SET_ATTR_ATIME_NOW
         if (to_set & FUSE_SET_ATTR_ATIME_NOW)
-            in->i_st.st_atime = std::time(nullptr);
+            in->atime = to_ns(now);
         else
 #endif
           if (to_set & FUSE_SET_ATTR_ATIME)
-            in->i_st.st_atime = attr->st_atime;
+            in->atime = to_ns(attr->st_atim);
     }
 
 #ifdef FUSE_SET_ATTR_CTIME
     if (to_set & FUSE_SET_ATTR_CTIME) {
         if (uid && in->i_st.st_uid != uid) return -EPERM;
-        in->i_st.st_ctime = attr->st_ctime;
+        in->changed(attr->st_ctim);
     }
 #endif
 
@@ -1042,53 +1916,55 @@ int FileSystem::setattr(
         // impose maximum size of 2TB
         if (attr->st_size > 2199023255552) return -EFBIG;
 
-        assert(in->is_regular());
-        auto reg_in = std::dynamic_pointer_cast<RegInode>(in);
+        auto reg_in = in->as<RegInode>();
+        assert(reg_in);
         int ret = truncate(reg_in, attr->st_size, uid, gid);
+        publish(reg_in);
         if (ret < 0) return ret;
 
-        in->i_st.st_mtime = now;
+        in->i_st.st_mtim = now;
     }
 
-    in->i_st.st_ctime = now;
+    in->changed(now);
 
     if (to_set & FUSE_SET_ATTR_MODE) in->i_st.st_mode &= ~clear_mode;
 
-    *attr = in->i_st;
+    in->fill_stat(attr);
 
     return 0;
 }
 
 int FileSystem::symlink(
-  const std::string& link,
+  std::string_view link,
   fuse_ino_t parent_ino,
-  const std::string& name,
+  std::string_view name,
   struct stat* st,
   uid_t uid,
   gid_t gid) {
     if (name.length() > NAME_MAX) return -ENAMETOOLONG;
 
-    auto now = std::time(nullptr);
+    auto now = coarse_now();
 
-    auto in = std::make_shared<SymlinkInode>(
-      next_ino_++, now, uid, gid, 4096, link, this);
+    auto in = make_ref<SymlinkInode>(next_ino_++, now, uid, gid, link);
 
     std::lock_guard<std::mutex> l(mutex_);
 
     auto parent_in = dir_inode(parent_ino);
-    DirInode::dir_t& children = parent_in->dentries;
-    if (children.find(name) != children.end()) return -EEXIST;
+    if (parent_in->dentries.find(name)) return -EEXIST;
 
     int ret = access(parent_in, W_OK, uid, gid);
     if (ret) return ret;
 
-    children[name] = in;
-    add_inode(in);
+    ret = charge_inode(in.get());
+    if (ret) return ret;
+
+    parent_in->add(name, in.get());
+    add_inode(in.get());
+    invalidate_negative(parent_ino, name);
 
-    parent_in->i_st.st_ctime = now;
-    parent_in->i_st.st_mtime = now;
+    parent_in->modified(now);
 
-    *st = in->i_st;
+    in->fill_stat(st);
 
     return 0;
 }
@@ -1139,7 +2015,7 @@ int FileSystem::statfs(fuse_ino_t ino, struct statvfs* stbuf) {
 int FileSystem::link(
   fuse_ino_t ino,
   fuse_ino_t newparent_ino,
-  const std::string& newname,
+  std::string_view newname,
   struct stat* st,
   uid_t uid,
   gid_t gid) {
@@ -1148,8 +2024,7 @@ int FileSystem::link(
     std::lock_guard<std::mutex> l(mutex_);
 
     auto newparent_in = dir_inode(newparent_ino);
-    if (newparent_in->dentries.find(newname) != newparent_in->dentries.end())
-        return -EEXIST;
+    if (newparent_in->dentries.find(newname)) return -EEXIST;
 
     auto in = inode(ino);
 
@@ -1158,25 +2033,24 @@ int FileSystem::link(
     int ret = access(newparent_in, W_OK, uid, gid);
     if (ret) return ret;
 
-    auto now = std::time(nullptr);
+    auto now = coarse_now();
 
     // bump in kernel inode cache reference count
     get_inode(in);
 
-    in->i_st.st_ctime = now;
+    in->changed(now);
     in->i_st.st_nlink++;
 
-    newparent_in->i_st.st_ctime = now;
-    newparent_in->i_st.st_mtime = now;
-    newparent_in->dentries[newname] = in;
+    newparent_in->modified(now);
+    newparent_in->add(newname, in);
+    invalidate_negative(newparent_ino, newname);
 
-    *st = in->i_st;
+    in->fill_stat(st);
 
     return 0;
 }
 
-int FileSystem::access(
-  const std::shared_ptr<Inode>& in, int mask, uid_t uid, gid_t gid) {
+int FileSystem::access(Inode* in, int mask, uid_t uid, gid_t gid) {
     if (mask == F_OK) return 0;
 
     assert(mask & (R_OK | W_OK | X_OK));
@@ -1242,7 +2116,7 @@ int FileSystem::access(fuse_ino_t ino, int mask, uid_t uid, gid_t gid) {
  */
 int FileSystem::mknod(
   fuse_ino_t parent_ino,
-  const std::string& name,
+  std::string_view name,
   mode_t mode,
   dev_t rdev,
   struct stat* st,
@@ -1250,11 +2124,10 @@ int FileSystem::mknod(
   gid_t gid) {
     if (name.length() > NAME_MAX) return -ENAMETOOLONG;
 
-    auto now = std::time(nullptr);
+    auto now = coarse_now();
 
     // TODO: may not be Regular Inode?
-    auto in = std::make_shared<RegInode>(
-      next_ino_++, now, uid, gid, 4096, mode, this);
+    auto in = make_ref<RegInode>(next_ino_++, now, uid, gid, mode, this);
 
     // directories start with nlink = 2, but according to mknod(2), "Under
     // Linux, mknod() cannot be used to create directories.  One should make
@@ -1264,131 +2137,889 @@ int FileSystem::mknod(
     std::lock_guard<std::mutex> l(mutex_);
 
     auto parent_in = dir_inode(parent_ino);
-    DirInode::dir_t& children = parent_in->dentries;
-    if (children.find(name) != children.end()) return -EEXIST;
+    if (parent_in->dentries.find(name)) return -EEXIST;
 
     int ret = access(parent_in, W_OK, uid, gid);
     if (ret) return ret;
 
-    children[name] = in;
-    add_inode(in);
+    ret = charge_inode(in.get());
+    if (ret) return ret;
+
+    parent_in->add(name, in.get());
+    add_inode(in.get());
+    invalidate_negative(parent_ino, name);
 
-    parent_in->i_st.st_ctime = now;
-    parent_in->i_st.st_mtime = now;
+    parent_in->modified(now);
 
-    *st = in->i_st;
+    in->fill_stat(st);
 
     return 0;
 }
 
-int FileSystem::opendir(fuse_ino_t ino, int flags, uid_t uid, gid_t gid) {
+int FileSystem::opendir(
+  fuse_ino_t ino, int flags, DirHandle** dhp, uid_t uid, gid_t gid) {
     std::lock_guard<std::mutex> l(mutex_);
 
-    auto in = inode(ino);
+    auto in = dir_inode(ino);
 
     if ((flags & O_ACCMODE) == O_RDONLY) {
         int ret = access(in, R_OK, uid, gid);
         if (ret) return ret;
     }
 
+    *dhp = new DirHandle(in);
+    in->opens++;
+
     return 0;
 }
 
 /*
- * This is a work-in-progress. It currently is functioning, but I think that
- * the it is not robust against concurrent modifications. The common
- * approach it seems is to encode a cookie in the offset parameter. Current
- * we just do an in-order traversal of the directory and return the Nth
- * item.
+ * Return the cached stream of a directory, building it if the directory has
+ * changed since it was last listed. A stream takes space from the file system
+ * for as long as the cache or a handle holds it. When there isn't enough the
+ * listing is still served, but not cached.
  */
-ssize_t FileSystem::readdir(
-  fuse_req_t req, fuse_ino_t ino, char* buf, size_t bufsize, off_t off) {
-    std::lock_guard<std::mutex> l(mutex_);
+std::shared_ptr<const DirStream>
+FileSystem::dir_stream(fuse_req_t req, DirInode* in) {
+    if (in->stream) return in->stream;
 
-    struct stat st;
-    memset(&st, 0, sizeof(st));
+    auto stream = std::make_unique<DirStream>();
+    stream->entries.reserve(in->dentries.size() + 2);
 
-    size_t pos = 0;
+    auto add = [&](const char* name, fuse_ino_t ino, off_t off) {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_ino = ino;
+        const size_t pos = stream->buf.size();
+        const size_t size = fuse_add_direntry(req, NULL, 0, name, &st, 0);
+        stream->buf.resize(pos + size);
+        fuse_add_direntry(req, &stream->buf[pos], size, name, &st, off + 1);
+        stream->entries.emplace_back(off, pos);
+    };
 
     /*
      * FIXME: the ".." directory correctly shows up at the parent directory
      * inode, but "." shows a inode number as "?" with ls -lia.
      */
-    if (off == 0) {
-        size_t remaining = bufsize - pos;
-        memset(&st, 0, sizeof(st));
-        st.st_ino = 1;
-        size_t used = fuse_add_direntry(req, buf + pos, remaining, ".", &st, 1);
-        if (used > remaining) return pos;
-        pos += used;
-        off = 1;
+    add(".", 1, 0);
+    add("..", 1, 1);
+
+    in->dentries.for_each(0, [&](const DirInode::Dentry& dentry) {
+        add(dentry.name.c_str(), dentry.inode->ino, dentry.cookie);
+        return true;
+    });
+
+    const size_t space = stream->space();
+    if (avail_bytes_ < space) return std::move(stream);
+    avail_bytes_ -= space;
+
+    // the last holder lets go with the file system lock held
+    in->stream = std::shared_ptr<const DirStream>(
+      stream.release(), [this, space](const DirStream* stream) {
+          avail_bytes_ += space;
+          delete stream;
+      });
+
+    return in->stream;
+}
+
+/*
+ * The offset is the readdir cookie of the next entry to return, see
+ * DirInode::dentries. Entries are copied out of the stream held by the handle
+ * and only building a stream takes the file system lock.
+ */
+ssize_t FileSystem::readdir(
+  fuse_req_t req, DirHandle* dh, char* buf, size_t bufsize, off_t off) {
+    if (off == 0 || !dh->stream) {
+        std::lock_guard<std::mutex> l(mutex_);
+        dh->stream = dir_stream(req, dh->in.get());
     }
 
-    if (off == 1) {
-        size_t remaining = bufsize - pos;
-        memset(&st, 0, sizeof(st));
-        st.st_ino = 1;
-        size_t used = fuse_add_direntry(
-          req, buf + pos, remaining, "..", &st, 2);
-        if (used > remaining) return pos;
-        pos += used;
-        off = 2;
+    const DirStream& stream = *dh->stream;
+    const auto& entries = stream.entries;
+
+    auto first = std::lower_bound(
+      entries.begin(),
+      entries.end(),
+      off,
+      [](const std::pair<off_t, size_t>& entry, off_t off) {
+          return entry.first < off;
+      });
+    if (first == entries.end()) return 0;
+
+    // copy as many whole entries as fit
+    const size_t start = first->second;
+    auto last = std::upper_bound(
+      first,
+      entries.end(),
+      start + bufsize,
+      [](size_t pos, const std::pair<off_t, size_t>& entry) {
+          return pos < entry.second;
+      });
+
+    size_t end;
+    if (last == entries.end() && stream.buf.size() - start <= bufsize)
+        end = stream.buf.size();
+    else
+        end = std::prev(last)->second;
+
+    memcpy(buf, stream.buf.data() + start, end - start);
+
+    return end - start;
+}
+
+void FileSystem::releasedir(fuse_ino_t ino, DirHandle* dh) {
+    assert(dh);
+    // the handle may hold the last reference to a removed directory
+    std::lock_guard<std::mutex> l(mutex_);
+    if (--dh->in->opens == 0) dh->in->stream.reset();
+    delete dh;
+}
+
+void FileSystem::free_space(RegInode* in, const Extent* extent) {
+    return_space(in, extent->cold() ? extent->zsize : extent->size);
+}
+
+/*
+ * Take space for a file and charge it to the owner. Fails with ENOSPC when
+ * the file system is full and EDQUOT when the owner is at their limit.
+ */
+int FileSystem::take_space(RegInode* in, size_t bytes) {
+    if (avail_bytes_ < bytes) return -ENOSPC;
+    if (quota_) {
+        int ret = quota_->charge(in->i_st.st_uid, in->i_st.st_gid, bytes, 0);
+        if (ret) return ret;
     }
+    avail_bytes_ -= bytes;
+    in->space += bytes;
+    return 0;
+}
 
-    assert(off >= 2);
+void FileSystem::return_space(RegInode* in, size_t bytes) {
+    assert(in->space >= bytes);
+    avail_bytes_ += bytes;
+    in->space -= bytes;
+    if (quota_) quota_->release(in->i_st.st_uid, in->i_st.st_gid, bytes, 0);
+}
+
+// count a new inode against its owner, before it is linked in
+int FileSystem::charge_inode(Inode* in) {
+    if (quota_) {
+        int ret = quota_->charge(in->i_st.st_uid, in->i_st.st_gid, 0, 1);
+        if (ret) return ret;
+    }
+    inode_counts_[in->type]++;
+    return 0;
+}
 
-    auto dir_in = dir_inode(ino);
-    const DirInode::dir_t& children = dir_in->dentries;
+// the last link to an inode is gone, even if it is still open
+void FileSystem::uncharge_inode(Inode* in) {
+    assert(inode_counts_[in->type] > 0);
+    inode_counts_[in->type]--;
+    if (quota_) quota_->release(in->i_st.st_uid, in->i_st.st_gid, 0, 1);
+}
 
-    size_t count = 0;
-    size_t target = off - 2;
-
-    for (DirInode::dir_t::const_iterator it = children.begin();
-         it != children.end();
-         it++) {
-        if (count >= target) {
-            auto in = it->second;
-            assert(in);
-            memset(&st, 0, sizeof(st));
-            st.st_ino = in->i_st.st_ino;
-            size_t remaining = bufsize - pos;
-            size_t used = fuse_add_direntry(
-              req, buf + pos, remaining, it->first.c_str(), &st, off + 1);
-            if (used > remaining) return pos;
-            pos += used;
-            off++;
+/*
+ * Move what an inode is charged to a new owner. A linked inode counts
+ * against its owner's inodes, and a regular file its space.
+ */
+int FileSystem::change_owner(Inode* in, uid_t uid, gid_t gid) {
+    if (quota_) {
+        auto reg_in = in->as<RegInode>();
+        int ret = quota_->transfer(
+          in->i_st.st_uid,
+          in->i_st.st_gid,
+          uid,
+          gid,
+          reg_in ? reg_in->space : 0,
+          in->i_st.st_nlink > 0);
+        if (ret) return ret;
+    }
+    in->i_st.st_uid = uid;
+    in->i_st.st_gid = gid;
+    return 0;
+}
+
+/*
+ * Make the writer's view of a file visible to readers. The extent list is
+ * only rebuilt if extents were added, replaced or removed since the last
+ * publish. Whatever readers may still be looking at is retired rather than
+ * freed.
+ */
+void FileSystem::publish(RegInode* in) {
+    const FileData* old = in->data_.load(std::memory_order_relaxed);
+    const WriteLog* log = in->log_.get();
+    const size_t log_records = log ? log->count : 0;
+    if (
+      !in->layout_changed_ && old->size == in->i_st.st_size && old->log == log
+      && old->log_records == log_records)
+        return;
+
+    const ExtentList* list = old->list;
+    if (in->layout_changed_) {
+        auto new_list = new ExtentList;
+        new_list->extents.reserve(in->extents_.size());
+        for (auto& it : in->extents_) {
+            it.second->published = true;
+            new_list->extents.emplace_back(it.first, it.second.get());
+        }
+        list = new_list;
+    }
+
+    in->data_.store(new FileData{in->i_st.st_size, list, log, log_records});
+
+    epochs().retire(old);
+    if (list != old->list) epochs().retire(old->list);
+    for (auto& extent : in->retired_)
+        epochs().retire(extent.release());
+    if (in->retired_log_) epochs().retire(in->retired_log_.release());
+
+    in->retired_.clear();
+    in->layout_changed_ = false;
+
+    epochs().reclaim();
+}
+
+/*
+ * Prepare the extent at @it to be modified from file offset @offset onward.
+ * Bytes that readers may see can't be changed in place, so unless the change
+ * is past the end of the file as of the last publish, the extent is replaced
+ * by a private copy. This is also how a cold extent is brought back to hot.
+ */
+int FileSystem::writable_extent(
+  RegInode* in,
+  RegInode::extent_map_t::iterator it,
+  off_t offset,
+  Extent** extentp) {
+    Extent* extent = it->second.get();
+
+    const off_t visible = in->data_.load(std::memory_order_relaxed)->size;
+    if (!extent->cold() && (!extent->published || offset >= visible)) {
+        *extentp = extent;
+        return 0;
+    }
+
+    // the copy takes over the space of the extent it replaces
+    const size_t old_space = extent->cold() ? extent->zsize : extent->size;
+    int ret = take_space(in, extent->size - old_space);
+    if (ret) return ret;
+
+    auto copy = std::make_unique<Extent>(extent->size);
+    if (extent->cold()) {
+        inflate_extent(*extent, copy->buf.get(), extent->size);
+        track_idle(in, it->first, copy->last_access);
+    } else {
+        std::memcpy(copy->buf.get(), extent->buf.get(), extent->size);
+        copy->last_access.store(extent->last_access.load());
+    }
+
+    in->retired_.push_back(std::move(it->second));
+    it->second = std::move(copy);
+    in->layout_changed_ = true;
+
+    *extentp = it->second.get();
+
+    return 0;
+}
+
+/*
+ * Remove an extent from a file and return its space. Returns the iterator
+ * following the removed extent.
+ */
+RegInode::extent_map_t::iterator
+FileSystem::retire_extent(RegInode* in, RegInode::extent_map_t::iterator it) {
+    free_space(in, it->second.get());
+    in->retired_.push_back(std::move(it->second));
+    in->layout_changed_ = true;
+    return in->extents_.erase(it);
+}
+
+/*
+ * Append a write to the log of a file. The write must fall within the file.
+ * A full log is grown, or merged once it is as big as it gets. Only the
+ * logged bytes are charged, and the write goes to the extents when there
+ * isn't space for them.
+ */
+ssize_t FileSystem::log_write(
+  RegInode* in, off_t offset, size_t size, const char* buf) {
+    assert((off_t)(offset + size) <= in->i_st.st_size);
+
+    if (size > log_capacity) return write_unlogged(in, offset, size, buf);
+
+    if (in->log_ && in->log_->full(size) && !grow_log(in, size)) {
+        int ret = merge_log(in);
+        if (ret) return ret;
+    }
+
+    if (take_space(in, size)) return write_unlogged(in, offset, size, buf);
+
+    if (!in->log_) {
+        size_t capacity = log_min_capacity;
+        while (capacity < size)
+            capacity *= 2;
+        in->log_ = std::make_unique<WriteLog>(capacity, log_min_records);
+    }
+
+    auto now = coarse_now();
+    in->modified(now);
+
+    // records past those that have been published are not seen by readers
+    WriteLog* log = in->log_.get();
+    const size_t pos = log->used;
+    std::memcpy(log->buf.get() + pos, buf, size);
+    log->records[log->count++] = WriteLog::Record{offset, size, pos};
+    log->used += size;
+
+    // the write replaces whatever the index has for its range, trimming or
+    // splitting the ranges at either end.
+    auto& index = log->index;
+    const off_t end = offset + size;
+
+    auto it = index.lower_bound(offset);
+    if (it != index.begin()) {
+        auto prev = std::prev(it);
+        const off_t prev_end = prev->first + prev->second.first;
+        if (prev_end > offset) {
+            if (prev_end > end) {
+                const size_t pos = prev->second.second + (end - prev->first);
+                index.emplace(end, std::make_pair(prev_end - end, pos));
+            }
+            prev->second.first = offset - prev->first;
+        }
+    }
+
+    while (it != index.end() && it->first < end) {
+        const off_t it_end = it->first + it->second.first;
+        if (it_end > end) {
+            const size_t pos = it->second.second + (end - it->first);
+            index.emplace(end, std::make_pair(it_end - end, pos));
+        }
+        it = index.erase(it);
+    }
+
+    index.emplace(offset, std::make_pair(size, pos));
+
+    return size;
+}
+
+/*
+ * Write to the extents of a file that may have a log. Logged data that the
+ * write overlaps is merged first, or replaying the log would undo the write.
+ */
+ssize_t FileSystem::write_unlogged(
+  RegInode* in, off_t offset, size_t size, const char* buf) {
+    if (in->log_ && in->log_->overlaps(offset, size)) {
+        int ret = merge_log(in);
+        if (ret) return ret;
+    }
+    return write(in, offset, size, buf);
+}
+
+/*
+ * Apply the newest data in the log of a file to its extents and drop the
+ * log. If that fails part way the log is kept: ranges that were applied
+ * are simply applied again later.
+ */
+int FileSystem::merge_log(RegInode* in) {
+    if (!in->log_) return 0;
+
+    const auto mtime = in->i_st.st_mtim;
+    const auto ctime = in->ctime.load(std::memory_order_relaxed);
+
+    const WriteLog* log = in->log_.get();
+    for (const auto& range : log->index) {
+        const size_t size = range.second.first;
+        const char* buf = log->buf.get() + range.second.second;
+        ssize_t ret = write(in, range.first, size, buf);
+        if (ret < 0) return ret;
+    }
+
+    // the data was written when it was logged
+    in->i_st.st_mtim = mtime;
+    in->ctime.store(ctime, std::memory_order_relaxed);
+
+    log_->debug(
+      "merged {} log records into ino {} as {} writes",
+      log->count,
+      in->ino,
+      log->index.size());
+
+    drop_log(in);
+
+    return 0;
+}
+
+/*
+ * Double the buffer or records of a log that can't take a write of @size,
+ * unless that would take it past its limits.
+ */
+bool FileSystem::grow_log(RegInode* in, size_t size) {
+    const WriteLog* log = in->log_.get();
+    if (log->used + size > log_capacity || log->count == log_max_records)
+        return false;
+
+    size_t capacity = log->capacity;
+    while (log->used + size > capacity)
+        capacity *= 2;
+    size_t max_records = log->max_records;
+    if (log->count == max_records) max_records *= 2;
+
+    auto grown = std::make_unique<WriteLog>(*log, capacity, max_records);
+    retire_log(in);
+    in->log_ = std::move(grown);
+
+    return true;
+}
+
+void FileSystem::drop_log(RegInode* in) {
+    if (!in->log_) return;
+    return_space(in, in->log_->used);
+    retire_log(in);
+}
+
+/*
+ * The published log may still be replayed by readers, so it is retired with
+ * the next publish. A log that readers never saw is freed right away.
+ */
+void FileSystem::retire_log(RegInode* in) {
+    if (in->data_.load(std::memory_order_relaxed)->log != in->log_.get()) {
+        in->log_.reset();
+        return;
+    }
+    assert(!in->retired_log_);
+    in->retired_log_ = std::move(in->log_);
+}
+
+void FileSystem::compress_loop() {
+    const auto period = std::chrono::seconds(
+      std::max(compress_after_ / 2, (time_t)1));
+
+    std::unique_lock<std::mutex> l(mutex_);
+    while (!compressor_stop_) {
+        compressor_cv_.wait_for(l, period);
+        if (compressor_stop_) break;
+        l.unlock();
+        compress_pass();
+        l.lock();
+    }
+}
+
+/*
+ * Note a new hot extent of a file, or one that came back from cold, so that
+ * the compressor gets to it. Extents that are only copied on write keep the
+ * entry they have.
+ */
+void FileSystem::track_idle(RegInode* in, off_t offset, time_t stamp) {
+    if (compress_after_ > 0) idle_.push(IdleExtent{stamp, in->ino, offset});
+}
+
+/*
+ * Bring back the cold extents that have been read since the last pass, and
+ * compress the extents that haven't been read or written in the last
+ * compress_after_ seconds. Only the extents whose idle entries have come up
+ * are looked at, rather than every file. One that was used since it was
+ * queued is queued again as of its last use. Each candidate is copied out
+ * under the lock and compressed without holding it, and the result replaces
+ * the extent only if it wasn't touched in the meantime.
+ */
+void FileSystem::compress_pass() {
+    const auto cutoff = std::time(nullptr) - compress_after_;
+    size_t count = 0, saved = 0, thawed = 0;
+    std::vector<char> raw, packed;
+
+    std::vector<std::pair<fuse_ino_t, off_t>> thaw;
+    {
+        std::lock_guard<std::mutex> l(thaw_mutex_);
+        thaw.swap(thaw_);
+    }
+
+    std::unique_lock<std::mutex> l(mutex_);
+
+    for (const auto& entry : thaw) {
+        auto in = inodes_.find(entry.first);
+        auto reg_in = in ? in->as<RegInode>() : nullptr;
+        if (!reg_in) continue;
+
+        auto it = reg_in->extents_.find(entry.second);
+        if (it == reg_in->extents_.end() || !it->second->cold()) continue;
+
+        Extent* hot;
+        if (writable_extent(reg_in, it, 0, &hot) == 0) {
+            thawed++;
+            publish(reg_in);
+        }
+    }
+
+    while (!idle_.empty() && idle_.top().stamp <= cutoff) {
+        if (compressor_stop_) break;
+
+        const IdleExtent entry = idle_.top();
+        idle_.pop();
+
+        auto in = inodes_.find(entry.ino);
+        auto reg_in = in ? in->as<RegInode>() : nullptr;
+        if (!reg_in) continue;
+
+        auto it = reg_in->extents_.find(entry.offset);
+        if (it == reg_in->extents_.end() || it->second->cold()) continue;
+
+        const Extent* target = it->second.get();
+        const time_t last_access = target->last_access;
+        if (last_access > cutoff) {
+            idle_.push(IdleExtent{last_access, entry.ino, entry.offset});
+            continue;
+        }
+
+        raw.assign(target->buf.get(), target->buf.get() + target->size);
+
+        // the reference keeps the file around while the lock is dropped, and
+        // is only let go of under the lock. the guard keeps the target from
+        // being reclaimed, and its address reused, in the meantime.
+        Ref<RegInode> ref(reg_in);
+        EpochGuard guard(epochs());
+        l.unlock();
+
+        uLongf zsize = compressBound(raw.size());
+        packed.resize(zsize);
+        int ret = compress2(
+          (Bytef*)packed.data(),
+          &zsize,
+          (const Bytef*)raw.data(),
+          raw.size(),
+          Z_BEST_SPEED);
+
+        l.lock();
+
+        it = reg_in->extents_.find(entry.offset);
+        if (
+          it == reg_in->extents_.end() || it->second.get() != target
+          || target->last_access != last_access) {
+            // changed while it was being compressed. a copy-on-write keeps
+            // the place of the extent, so it needs an entry again.
+            if (it != reg_in->extents_.end() && !it->second->cold())
+                track_idle(reg_in, entry.offset, it->second->last_access);
+            continue;
         }
+
+        auto& extent = it->second;
+
+        // not worth it. treat the extent as touched so that it is not
+        // considered again for another full period.
+        if (ret != Z_OK || zsize > extent->size - extent->size / 8) {
+            extent->last_access = std::time(nullptr);
+            track_idle(reg_in, entry.offset, extent->last_access);
+            continue;
+        }
+
+        std::unique_ptr<char[]> zbuf(new char[zsize]);
+        std::memcpy(zbuf.get(), packed.data(), zsize);
+        auto cold =
+          std::make_unique<Extent>(extent->size, std::move(zbuf), zsize);
+        cold->last_access.store(last_access);
+
+        return_space(reg_in, extent->size - zsize);
+        saved += extent->size - zsize;
         count++;
+
+        reg_in->retired_.push_back(std::move(extent));
+        extent = std::move(cold);
+        reg_in->layout_changed_ = true;
+        publish(reg_in);
+    }
+
+    l.unlock();
+
+    if (count || thawed) {
+        log_->debug(
+          "compressed {} cold extents saving {} bytes, thawed {}",
+          count,
+          saved,
+          thawed);
     }
+}
+
+void FileSystem::stop_compressor() {
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        compressor_stop_ = true;
+    }
+    compressor_cv_.notify_all();
+    if (compressor_.joinable()) compressor_.join();
+}
 
-    return pos;
+/*
+ * The kernel updates its own caches for the objects named in a request, so
+ * invalidation is only needed when a request changes other objects that the
+ * kernel may have cached. Notifications are sent from a separate thread
+ * since the kernel may need locks that it holds for the request in progress.
+ * The caller holds the file system lock.
+ */
+void FileSystem::invalidate_inode(const Inode& in, off_t off, off_t len) {
+    if (in.krefs == 0) return;
+    notifications_.push_back(
+      Notification{Notification::INVAL_INODE, in.ino, {}, off, len, nullptr});
+    notifier_cv_.notify_one();
 }
 
-void FileSystem::releasedir(fuse_ino_t ino) {}
+// push file data into the kernel page cache. it is read when it is sent.
+void FileSystem::store_inode(RegInode* in, off_t off, off_t len) {
+    if (in->krefs == 0) return;
+    notifications_.push_back(
+      Notification{Notification::STORE, in->ino, {}, off, len, in});
+    notifier_cv_.notify_one();
+}
+
+void FileSystem::notify_loop() {
+    std::unique_lock<std::mutex> l(mutex_);
+    while (!notifier_stop_) {
+        if (notifications_.empty()) {
+            notifier_cv_.wait(l);
+            continue;
+        }
+
+        std::deque<Notification> pending;
+        pending.swap(notifications_);
+
+        l.unlock();
+        std::vector<char> buf;
+        for (auto& notif : pending) {
+            // the kernel may have dropped the inode or entry in the meantime
+            int ret = 0;
+            switch (notif.op) {
+            case Notification::INVAL_INODE:
+                ret = notify_inval_inode(notif.ino, notif.off, notif.len);
+                break;
+            case Notification::INVAL_ENTRY:
+                ret = notify_inval_entry(notif.ino, notif.name);
+                break;
+            case Notification::STORE:
+                buf.resize(store_chunk);
+                for (off_t off = notif.off, end = off + notif.len; off < end;) {
+                    const size_t want = std::min(end - off, (off_t)store_chunk);
+                    ssize_t got
+                      = read_file(notif.in.get(), off, want, buf.data());
+                    if (got <= 0) break;
+                    ret = notify_store(notif.ino, off, buf.data(), got);
+                    if (ret) break;
+                    off += got;
+                }
+                // the last reference to an unlinked file is dropped under
+                // the lock
+                l.lock();
+                notif.in.reset();
+                l.unlock();
+                break;
+            }
+            if (ret && ret != -ENOENT) {
+                log_->debug(
+                  "notify ino {} name {} ret {}", notif.ino, notif.name, ret);
+            }
+        }
+        l.lock();
+    }
+}
 
-void FileSystem::free_space(Extent* extent) {
-    extent->buf.release();
-    avail_bytes_ += extent->size;
+/*
+ * Lookup misses are replied to with a negative entry that the kernel caches
+ * for negative_timeout_ seconds. Creating an entry under a name the kernel
+ * may still have cached as missing invalidates it. Only misses from within
+ * the timeout are remembered, and they are expired in the order they were
+ * made.
+ */
+void FileSystem::remember_negative(
+  fuse_ino_t parent_ino, std::string_view name) {
+    const auto now = clock::now();
+    expire_negatives(now);
+
+    // the kernel starts the timeout when it gets the reply, so allow for
+    // the reply being in flight
+    const auto timeout = std::chrono::duration_cast<clock::duration>(
+      std::chrono::duration<double>(negative_timeout_ + 1));
+    const auto expires = now + timeout;
+
+    auto key = std::make_pair(parent_ino, std::string(name));
+    negatives_[key] = expires;
+    negative_expiry_.emplace_back(expires, std::move(key));
 }
 
-int FileSystem::truncate(
-  const std::shared_ptr<RegInode>& in, off_t newsize, uid_t uid, gid_t gid) {
+void FileSystem::invalidate_negative(
+  fuse_ino_t parent_ino, std::string_view name) {
+    if (negatives_.empty()) return;
+
+    const auto now = clock::now();
+    expire_negatives(now);
+
+    auto key = std::make_pair(parent_ino, std::string(name));
+    auto it = negatives_.find(key);
+    if (it == negatives_.end()) return;
+
+    const bool expired = it->second <= now;
+    negatives_.erase(it);
+    if (expired) return;
+
+    notifications_.push_back(Notification{
+      Notification::INVAL_ENTRY,
+      parent_ino,
+      std::move(key.second),
+      0,
+      0,
+      nullptr});
+    notifier_cv_.notify_one();
+}
+
+void FileSystem::expire_negatives(clock::time_point now) {
+    while (!negative_expiry_.empty() && negative_expiry_.front().first <= now) {
+        const auto& front = negative_expiry_.front();
+        // a later miss of the same name extends it
+        auto it = negatives_.find(front.second);
+        if (it != negatives_.end() && it->second == front.first)
+            negatives_.erase(it);
+        negative_expiry_.pop_front();
+    }
+}
+
+void FileSystem::stop_notifier() {
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        notifier_stop_ = true;
+    }
+    notifier_cv_.notify_all();
+    if (notifier_.joinable()) notifier_.join();
+}
+
+void FileSystem::load_throttle() {
+    std::string err;
+    if (throttle_->load(throttle_path_, &err)) {
+        log_->error("throttle: {}, keeping the current limits", err);
+        return;
+    }
+    log_->info("throttle: loaded limits from {}", throttle_path_);
+}
+
+void FileSystem::load_quota() {
+    std::string err;
+    std::lock_guard<std::mutex> l(mutex_);
+    if (quota_->load(quota_path_, &err)) {
+        log_->error("quota: {}, keeping the current limits", err);
+        return;
+    }
+    log_->info("quota: loaded limits from {}", quota_path_);
+}
+
+/*
+ * Handle the control signals. SIGUSR1 reloads the limits, which starts every
+ * throttled tenant over with full buckets, and SIGUSR2 logs what each tenant
+ * has done so far and what it is using.
+ */
+void FileSystem::control_loop() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+
+    while (!control_stop_) {
+        int sig;
+        if (sigwait(&set, &sig) || control_stop_) continue;
+
+        if (sig == SIGUSR1) {
+            if (throttle_) load_throttle();
+            if (quota_) load_quota();
+        } else if (sig == SIGUSR2) {
+            if (throttle_) {
+                for (auto& t : throttle_->stats()) {
+                    log_->info(
+                      "throttle: {}: {} requests, {} bytes, {} delayed for "
+                      "{:.3f}s",
+                      t.first,
+                      t.second.requests,
+                      t.second.bytes,
+                      t.second.delayed,
+                      t.second.delay);
+                }
+            }
+            if (quota_) {
+                std::lock_guard<std::mutex> l(mutex_);
+                for (auto& t : quota_->report()) {
+                    log_->info(
+                      "quota: {}: {}/{} bytes, {}/{} inodes",
+                      t.first,
+                      t.second.first.bytes,
+                      t.second.second.bytes,
+                      t.second.first.inodes,
+                      t.second.second.inodes);
+                }
+            }
+        }
+    }
+}
+
+void FileSystem::stop_control() {
+    if (!control_.joinable()) return;
+    control_stop_ = true;
+    pthread_kill(control_.native_handle(), SIGUSR1);
+    control_.join();
+}
+
+/*
+ * Decide how a new file handle uses the kernel page cache. Opens with
+ * O_DIRECT always bypass it. A file that keeps being opened for reading is
+ * pushed into the cache up front if it is small enough, so that its reads
+ * don't have to come here.
+ */
+void FileSystem::cache_policy(RegInode* in, FileHandle* fh) {
+    fh->direct_io = cache_mode_ == CACHE_DIRECT || (fh->flags & O_DIRECT);
+    fh->keep_cache = cache_mode_ == CACHE_KEEP;
+
+    if (!fh->keep_cache || fh->direct_io || !populate_max_) return;
+    if ((fh->flags & O_ACCMODE) == O_WRONLY) return;
+
+    const off_t size = in->i_st.st_size;
+    if (
+      ++in->read_opens >= populate_opens && !in->populated && size > 0
+      && (size_t)size <= populate_max_) {
+        store_inode(in, 0, size);
+        in->populated = true;
+    }
+}
+
+/*
+ * Writes through the page cache keep it up to date. Writes that bypass it
+ * leave stale pages behind for other handles, which are dropped, or
+ * replaced if the file has been pushed into the cache.
+ */
+void FileSystem::direct_written(FileHandle* fh, off_t off, size_t size) {
+    if (!fh->direct_io || cache_mode_ == CACHE_DIRECT) return;
+
+    if (fh->in->populated)
+        store_inode(fh->in.get(), off, size);
+    else
+        invalidate_inode(*fh->in, off, size);
+}
+
+/*
+ * Changes to the extents of a file are made visible to readers by the caller
+ * with publish().
+ */
+int FileSystem::truncate(RegInode* in, off_t newsize, uid_t uid, gid_t gid) {
     // easy: nothing to do
     if (in->i_st.st_size == newsize) {
         return 0;
 
         // easy: free all extents
     } else if (newsize == 0) {
-        for (auto& it : in->extents_) {
-            free_space(&it.second);
-        }
-        in->extents_.clear();
+        drop_log(in);
+        for (auto it = in->extents_.begin(); it != in->extents_.end();)
+            it = retire_extent(in, it);
         in->i_st.st_size = 0;
 
         // shrink file. the basic strategy is to free all extents past newsize
         // offset. we have to be careful if newsize falls into an extent and not
         // free that extent.
     } else if (newsize < in->i_st.st_size) {
+        // the write log only ever covers data within the file
+        int ret = merge_log(in);
+        if (ret) return ret;
+
         // find extent that could intersect newsize
         auto it = in->extents_.upper_bound(newsize);
         if (it != in->extents_.begin()) {
@@ -1412,79 +3043,110 @@ int FileSystem::truncate(
         // be handled correctly during read. if newsize == extent_offset then
         // the actual last byte falls before the extent and we still remove it.
         if (newsize <= extent_offset) {
-            for (auto it2 = it; it2 != in->extents_.end(); it2++) {
-                free_space(&it2->second);
-            }
-            in->extents_.erase(it, in->extents_.end());
+            while (it != in->extents_.end())
+                it = retire_extent(in, it);
             in->i_st.st_size = newsize;
             return 0;
         }
 
-        const auto& extent = it->second;
-        off_t extent_end = extent_offset + extent.size;
+        // newsize lands within or past the extent, so it is kept and only the
+        // extents after it are freed. data past newsize is zeroed so that it
+        // isn't exposed again if the file is later extended by a write.
+        off_t extent_end = extent_offset + it->second->size;
+        if (newsize < extent_end) {
+            Extent* extent;
+            int ret = writable_extent(in, it, newsize, &extent);
+            if (ret) return ret;
 
-        if (newsize <= extent_end) it++;
+            size_t blkoff = newsize - extent_offset;
+            memset(extent->buf.get() + blkoff, 0, extent_end - newsize);
 
-        for (auto it2 = it; it2 != in->extents_.end(); it2++) {
-            free_space(&it2->second);
+            if (is_zero(extent->buf.get(), extent->size))
+                it = retire_extent(in, it);
+            else
+                it++;
+        } else {
+            it++;
         }
 
-        in->extents_.erase(it, in->extents_.end());
+        while (it != in->extents_.end())
+            it = retire_extent(in, it);
+
         in->i_st.st_size = newsize;
 
         return 0;
 
-        // expand file with zeros. the basic strategy here is create a big hole
-        // after the end of the file which will be zero filled during read. if
-        // the current end of file lands in an extent, then zero fill that
-        // because read can't tell if allocated space is part of that "hole".
+        // expand file with zeros. extents never hold data past the end of the
+        // file (the shrink case above and write both zero it), so the new
+        // range reads back as zeros without any fill.
     } else {
         assert(in->i_st.st_size < newsize);
+        in->i_st.st_size = newsize;
+    }
 
-        // find extent that could intersect newsize
-        auto it = in->extents_.upper_bound(in->i_st.st_size);
-        if (it != in->extents_.begin()) {
-            assert(!in->extents_.empty());
-            assert(it == in->extents_.end());
-            --it;
-        } else if (it == in->extents_.end()) {
-            // empty: could happen with small truncate then large truncate
-            // having not yet allocated any space (i.e. no writes).
-            in->i_st.st_size = newsize;
-            return 0;
-        }
-
-        assert(it != in->extents_.end());
-        off_t extent_offset = it->first;
-
-        assert(in->i_st.st_size >= extent_offset);
-
-        const auto& extent = it->second;
-        off_t extent_end = extent_offset + extent.size;
+    return 0;
+}
 
-        if (extent_end < in->i_st.st_size) {
-            in->i_st.st_size = newsize;
-            return 0;
+/*
+ * Cut the runs of whole zero blocks that a write to [@from, @to) of an
+ * extent left in it out of the extent, so that they read back as holes.
+ * Blocks are aligned to the start of the extent, and a run carries on into
+ * zeros that were already there. The data on either side is copied into new
+ * extents, which is no more than a copy-on-write of the extent costs.
+ * Returns the last extent left of it, or the one that follows it.
+ */
+RegInode::extent_map_t::iterator FileSystem::punch_zeros(
+  RegInode* in, RegInode::extent_map_t::iterator it, size_t from, size_t to) {
+    const size_t blksize = 4096;
+
+    for (;;) {
+        const Extent* extent = it->second.get();
+        const char* data = extent->buf.get();
+        const size_t size = extent->size;
+        auto zero = [&](size_t blk) {
+            return is_zero(data + blk, std::min(blksize, size - blk));
+        };
+
+        // the first zero block that the write covers. the last block of the
+        // extent may be short.
+        size_t start = (from + blksize - 1) / blksize * blksize;
+        while (start < size && start + std::min(blksize, size - start) <= to
+               && !zero(start))
+            start += blksize;
+        if (start >= size || start + std::min(blksize, size - start) > to)
+            return it;
+
+        size_t end = start;
+        while (end < size && zero(end))
+            end = std::min(end + blksize, size);
+        while (start && zero(start - blksize))
+            start -= blksize;
+
+        // the extent itself is retired, as readers may still see it, but its
+        // space carries over to the pieces that are kept.
+        const off_t offset = it->first;
+        in->retired_.push_back(std::move(it->second));
+        it = in->extents_.erase(it);
+        in->layout_changed_ = true;
+        return_space(in, end - start);
+
+        if (start) {
+            auto head = std::make_unique<Extent>(start);
+            std::memcpy(head->buf.get(), data, start);
+            in->extents_.emplace_hint(it, offset, std::move(head));
         }
 
-        size_t left = std::min(
-          extent_end - in->i_st.st_size, newsize - in->i_st.st_size);
-        assert(left);
+        if (end == size) return it;
 
-        char zeros[4096];
-        memset(zeros, 0, sizeof(zeros));
+        auto tail = std::make_unique<Extent>(size - end);
+        std::memcpy(tail->buf.get(), data + end, size - end);
+        track_idle(in, offset + end, tail->last_access);
+        it = in->extents_.emplace_hint(it, offset + end, std::move(tail));
 
-        while (left) {
-            size_t done = std::min(left, sizeof(zeros));
-            ssize_t ret = write(in, in->i_st.st_size, done, zeros);
-            assert(ret > 0);
-            left -= ret;
-        }
-
-        in->i_st.st_size = newsize;
+        if (to <= end) return it;
+        from = 0;
+        to -= end;
     }
-
-    return 0;
 }
 
 /*
@@ -1493,7 +3155,7 @@ int FileSystem::truncate(
  */
 int FileSystem::allocate_space(
   RegInode* in,
-  std::map<off_t, Extent>::iterator* it,
+  RegInode::extent_map_t::iterator* it,
   off_t offset,
   size_t size,
   bool upper_bound) {
@@ -1503,71 +3165,100 @@ int FileSystem::allocate_space(
     if (!upper_bound) size = std::max(size, (size_t)8192);
 
     // allocate some space
-    if (avail_bytes_ < size) return -ENOSPC;
-
-    avail_bytes_ -= size;
+    int ret = take_space(in, size);
+    if (ret) return ret;
 
-    auto ret = in->extents_.emplace(offset, Extent(size));
-    assert(ret.second);
-    *it = ret.first;
+    auto res = in->extents_.emplace(offset, std::make_unique<Extent>(size));
+    assert(res.second);
+    *it = res.first;
+    in->layout_changed_ = true;
+    track_idle(in, offset, res.first->second->last_access);
 
     return 0;
 }
 
+/*
+ * Changes to the extents of a file are made visible to readers by the caller
+ * with publish().
+ */
 ssize_t FileSystem::write(
-  const std::shared_ptr<RegInode>& in,
-  off_t offset,
-  size_t size,
-  const char* buf) {
-    auto now = std::time(nullptr);
-    in->i_st.st_ctime = now;
-    in->i_st.st_mtime = now;
+  RegInode* in, off_t offset, size_t size, const char* buf) {
+    auto now = coarse_now();
+    in->modified(now);
 
-    // find the first extent that could intersect the write
-    auto it = in->extents_.upper_bound(offset);
-    if (it != in->extents_.begin()) {
-        assert(!in->extents_.empty());
-        --it;
-    } else if (it == in->extents_.end()) {
-        assert(in->extents_.empty());
-        int ret = allocate_space(in.get(), &it, offset, size, false);
-        if (ret) return ret;
-    }
+    const bool stream = datapath_stream(size);
 
-    assert(it != in->extents_.end());
-    off_t seg_offset = it->first;
+    // find the first extent that could intersect the write. for an empty
+    // file this leaves the iterator at end().
+    auto it = in->extents_.upper_bound(offset);
+    if (it != in->extents_.begin()) --it;
 
     size_t left = size;
 
     while (left) {
-        // case 1. the offset is contained in a non-allocated region before the
-        // extent. allocate some space starting at the target offset that
-        // doesn't extend past the beginning of the extent.
-        if (offset < seg_offset) {
-#if 0
-      std::cout << "write:case1: offset=" << offset <<
-        " size=" << (seg_offset - offset) <<
-        " upper_bound=true"
-        << std::endl;
-#endif
-            int ret = allocate_space(
-              in.get(), &it, offset, seg_offset - offset, true);
+        // case 1. the offset is contained in a non-allocated region, either
+        // before the extent or past the last extent. leading blocks of zeros
+        // are left as a hole. otherwise allocate some space starting at the
+        // target offset that doesn't extend past the beginning of the extent,
+        // or past the next run of zero blocks, which is left as a hole too.
+        if (it == in->extents_.end() || offset < it->first) {
+            bool bounded = it != in->extents_.end();
+            size_t hole = bounded ? it->first - offset : left;
+
+            const size_t zeros = zero_blocks(buf, std::min(left, hole));
+            if (zeros) {
+                buf += zeros;
+                offset += zeros;
+                left -= zeros;
+
+                in->i_st.st_size = std::max(in->i_st.st_size, offset);
+
+                continue;
+            }
+
+            // no allocation is larger than 1mb, so look no further
+            const size_t span = std::min({left, hole, (size_t)(1ULL << 20)});
+            const size_t data = data_blocks(buf, span);
+            if (data < span) {
+                hole = data;
+                bounded = true;
+            }
+
+            int ret = allocate_space(in, &it, offset, hole, bounded);
             if (ret) return ret;
 
-            seg_offset = it->first;
+            // the write fills the front of the new extent. zero the rest so
+            // that it reads back as zeros if a later write extends the file
+            // past it.
+            auto& extent = it->second;
+            if (left < extent->size)
+                data_zero(
+                  extent->buf.get() + left, extent->size - left, stream);
 
             continue;
         }
 
-        const auto& extent = it->second;
-        off_t seg_end_offset = seg_offset + extent.size;
+        off_t seg_offset = it->first;
+        off_t seg_end_offset = seg_offset + it->second->size;
 
         // case 2. the offset falls within the current extent: write data
         if (offset < seg_end_offset) {
+            Extent* extent;
+            int ret = writable_extent(in, it, offset, &extent);
+            if (ret) return ret;
+            extent->last_access.store(now.tv_sec, std::memory_order_relaxed);
+
             size_t done = std::min(left, (size_t)(seg_end_offset - offset));
             size_t blkoff = offset - seg_offset;
 
-            std::memcpy(extent.buf.get() + blkoff, buf, done);
+            data_copy(extent->buf.get() + blkoff, buf, done, stream);
+
+            // zeroing out the entire extent turns it back into a hole, and
+            // whole zero blocks within it are cut out of it
+            if (is_zero(buf, done) && is_zero(extent->buf.get(), extent->size))
+                it = retire_extent(in, it);
+            else if (done >= 4096)
+                it = punch_zeros(in, it, blkoff, blkoff + done);
 
             buf += done;
             offset += done;
@@ -1578,58 +3269,93 @@ ssize_t FileSystem::write(
             continue;
         }
 
-        // case 3. the offset falls past the extent, and there are no more
-        // extents. in this case we extend the file allocation.
-        if (++it == in->extents_.end()) {
-            int ret = allocate_space(in.get(), &it, offset, left, false);
-            if (ret) return ret;
-
-            seg_offset = it->first;
-
-            continue;
-        }
-
-        // case 4. try the next extent
-        seg_offset = it->first;
+        // case 3. the offset falls past the extent. try the next extent, and
+        // if there are no more, case 1 extends the file allocation.
+        ++it;
     }
 
     return size;
 }
 
-Inode::~Inode() {}
+void Inode::destroy(const Inode* in) {
+    switch (in->type) {
+    case REGULAR:
+        delete static_cast<const RegInode*>(in);
+        break;
+    case DIRECTORY:
+        delete static_cast<const DirInode*>(in);
+        break;
+    case SYMLINK:
+        delete static_cast<const SymlinkInode*>(in);
+        break;
+    }
+}
 
 /*
  * FIXME: space should be freed here, but also when it is deleted, if there
  * are no other open file handles. Otherwise, space is only freed after the
  * file is deleted and the kernel releases its references.
+ *
+ * Readers hold a reference to the inode, so there are none left that could
+ * be looking at the current version of the data.
  */
 RegInode::~RegInode() {
     for (auto it = extents_.begin(); it != extents_.end(); it++)
-        fs_->free_space(&it->second);
+        fs_->free_space(this, it->second.get());
     extents_.clear();
-}
 
-bool Inode::is_regular() const { return i_st.st_mode & S_IFREG; }
+    fs_->drop_log(this);
+    retired_log_.reset();
 
-bool Inode::is_directory() const { return i_st.st_mode & S_IFDIR; }
+    assert(retired_.empty());
+    const FileData* data = data_.load();
+    delete data->list;
+    delete data;
+}
 
-bool Inode::is_symlink() const { return i_st.st_mode & S_IFLNK; }
+void DirInode::add(std::string_view name, Inode* in) {
+    assert(!dentries.find(name));
+    dentries.add(name, in);
+    stream.reset();
+}
+
+void DirInode::remove(Dentry* dentry) {
+    dentries.remove(dentry);
+    stream.reset();
+}
 
 enum {
     KEY_HELP,
 };
 
-struct filesystem_opts {
-    size_t size;
-    bool debug;
-};
-
 #define FS_OPT(t, p, v)                                                        \
     { t, offsetof(struct filesystem_opts, p), v }
 
 static struct fuse_opt fs_fuse_opts[] = {
   FS_OPT("size=%llu", size, 0),
   FS_OPT("-debug", debug, 1),
+  FS_OPT("compress_after=%u", compress_after, 0),
+  FS_OPT("stream_threshold=%llu", stream_threshold, 0),
+  FS_OPT("log_write_max=%u", log_write_max, 0),
+  FS_OPT("entry_timeout=%lf", entry_timeout, 0),
+  FS_OPT("attr_timeout=%lf", attr_timeout, 0),
+  FS_OPT("negative_timeout=%lf", negative_timeout, 0),
+  FS_OPT("cache=auto", cache, CACHE_AUTO),
+  FS_OPT("cache=keep", cache, CACHE_KEEP),
+  FS_OPT("cache=direct", cache, CACHE_DIRECT),
+  FS_OPT("populate=%llu", populate, 0),
+  FS_OPT("max_write=%llu", max_write, 0),
+  FS_OPT("max_read=%llu", max_read, 0),
+  FS_OPT("sched_slots=%u", sched_slots, 0),
+  FS_OPT("sched_small=%u", sched_small, 0),
+  FS_OPT("sched_bulk=%u", sched_bulk, 0),
+  FS_OPT("sched_bulk_size=%llu", sched_bulk_size, 0),
+  FS_OPT("throttle=%s", throttle, 0),
+  FS_OPT("quota=%s", quota, 0),
+  FS_OPT("strictatime", atime, ATIME_STRICT),
+  FS_OPT("relatime", atime, ATIME_RELATIME),
+  FS_OPT("noatime", atime, ATIME_NOATIME),
+  FS_OPT("lazytime", lazytime, 1),
   FUSE_OPT_KEY("-h", KEY_HELP),
   FUSE_OPT_KEY("--help", KEY_HELP),
   FUSE_OPT_END};
@@ -1637,6 +3363,26 @@ static struct fuse_opt fs_fuse_opts[] = {
 static void usage(const char* progname) {
     printf("file system options:\n"
            "    -o size=N          max file system size (bytes)\n"
+           "    -o compress_after=N compress data idle for N secs (0 = off)\n"
+           "    -o stream_threshold=N bypass the cpu cache for transfers >= N\n"
+           "    -o log_write_max=N log overwrites <= N bytes (0 = off)\n"
+           "    -o entry_timeout=T kernel caches names for T seconds\n"
+           "    -o attr_timeout=T  kernel caches attributes for T seconds\n"
+           "    -o negative_timeout=T kernel caches lookup misses for T secs\n"
+           "    -o cache=MODE      page cache: auto, keep or direct\n"
+           "    -o populate=N      push files <= N bytes into a kept cache\n"
+           "    -o max_write=N     largest write request (bytes)\n"
+           "    -o max_read=N      largest read request (bytes)\n"
+           "    -o sched_slots=N   run N requests at a time, metadata first\n"
+           "    -o sched_small=N   of which at most N small reads and writes\n"
+           "    -o sched_bulk=N    and at most N bulk reads and writes\n"
+           "    -o sched_bulk_size=N reads and writes >= N bytes are bulk\n"
+           "    -o throttle=FILE   per-uid/gid limits (SIGUSR1 reloads)\n"
+           "    -o quota=FILE      per-uid/gid space and inode limits\n"
+           "    -o strictatime     update access times on every read\n"
+           "    -o relatime        only on the first read after a change\n"
+           "    -o noatime         never update access times\n"
+           "    -o lazytime        update them when files are closed\n"
            "    -debug             turn on verbose logging\n");
 }
 
@@ -1662,6 +3408,24 @@ int main(int argc, char* argv[]) {
     // option defaults
     opts.size = 512 << 20;
     opts.debug = false;
+    opts.compress_after = 0;
+    opts.stream_threshold = datapath_stream_threshold;
+    opts.log_write_max = 0;
+    opts.entry_timeout = 1.0;
+    opts.attr_timeout = 1.0;
+    opts.negative_timeout = 0.0;
+    opts.cache = CACHE_AUTO;
+    opts.populate = 0;
+    opts.max_write = 1 << 20;
+    opts.max_read = 1 << 20;
+    opts.sched_slots = 0;
+    opts.sched_small = 0;
+    opts.sched_bulk = 0;
+    opts.sched_bulk_size = 128 << 10;
+    opts.throttle = nullptr;
+    opts.quota = nullptr;
+    opts.atime = ATIME_RELATIME;
+    opts.lazytime = 0;
 
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
@@ -1669,6 +3433,10 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
+    // the kernel caps reads that bypass readahead with the mount option
+    const std::string max_read = "-omax_read=" + std::to_string(opts.max_read);
+    fuse_opt_add_arg(&args, max_read.c_str());
+
     auto console = spdlog::stdout_color_mt("console");
     if (opts.debug) {
         console->set_level(spdlog::level::debug);
@@ -1678,10 +3446,12 @@ int main(int argc, char* argv[]) {
 
     assert(opts.size > 0);
 
+    datapath_stream_threshold = opts.stream_threshold;
+
     struct fuse_chan* ch;
     int err = -1;
 
-    FileSystem fs(opts.size, console);
+    FileSystem fs(opts, console);
 
     char* mountpoint = nullptr;
     if (
@@ -1693,7 +3463,9 @@ int main(int argc, char* argv[]) {
         if (se != NULL) {
             if (fuse_set_signal_handlers(se) != -1) {
                 fuse_session_add_chan(se, ch);
+                fs.set_chan(ch);
                 err = fuse_session_loop_mt(se);
+                fs.set_chan(nullptr);
                 fuse_remove_signal_handlers(se);
                 fuse_session_remove_chan(ch);
             }
@@ -1705,6 +3477,8 @@ int main(int argc, char* argv[]) {
     if (mountpoint) {
         free(mountpoint);
     }
+    free(opts.throttle);
+    free(opts.quota);
 
     int rv = err ? 1 : 0;
 
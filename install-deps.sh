@@ -10,7 +10,8 @@ function debs() {
   $SUDO apt-get install -y \
     cmake \
     pkg-config \
-    libfuse-dev
+    libfuse-dev \
+    zlib1g-dev
 }
 
 source /etc/os-release
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/*
+ * A directory entry name in 16 bytes.
+ *
+ * Most names fit in 15 bytes and are kept inline, with the last byte holding
+ * the unused length so that a 15 byte name ends in the zero it needs. Longer
+ * names are interned: every entry with the same long name shares one copy,
+ * which helps with trees that repeat the same generated names in every
+ * directory. A Name is immutable.
+ */
+class Name {
+public:
+    Name() { set_inline("", 0); }
+
+    Name(std::string_view s) {
+        if (s.size() <= max_inline)
+            set_inline(s.data(), s.size());
+        else
+            set_interned(intern(s));
+    }
+
+    Name(const Name& other) {
+        memcpy(bytes_, other.bytes_, sizeof(bytes_));
+        if (interned()) get(str_);
+    }
+
+    Name(Name&& other) {
+        memcpy(bytes_, other.bytes_, sizeof(bytes_));
+        other.set_inline("", 0);
+    }
+
+    ~Name() {
+        if (interned()) put(str_);
+    }
+
+    Name& operator=(Name other) {
+        char tmp[sizeof(bytes_)];
+        memcpy(tmp, bytes_, sizeof(bytes_));
+        memcpy(bytes_, other.bytes_, sizeof(bytes_));
+        memcpy(other.bytes_, tmp, sizeof(bytes_));
+        return *this;
+    }
+
+    const char* c_str() const { return interned() ? str_->data() : bytes_; }
+
+    size_t size() const {
+        return interned() ? str_->len : max_inline - bytes_[max_inline];
+    }
+
+    std::string_view view() const { return {c_str(), size()}; }
+    operator std::string_view() const { return view(); }
+
+    // long names in use, and the bytes they take
+    static size_t interned_count() { return table().count(); }
+    static size_t interned_bytes() { return table().bytes(); }
+
+private:
+    static constexpr size_t max_inline = 15;
+    static constexpr char interned_tag = -1;
+
+    struct Str {
+        uint32_t refs;
+        uint32_t len;
+
+        char* data() { return reinterpret_cast<char*>(this + 1); }
+    };
+
+    /*
+     * Long names by value. The keys point into the Strs themselves. Names are
+     * made and dropped under the file system lock, so the lock here is only
+     * taken uncontended.
+     */
+    class Table {
+    public:
+        Str* intern(std::string_view s) {
+            std::lock_guard<std::mutex> l(mutex_);
+            auto it = strs_.find(s);
+            if (it != strs_.end()) {
+                it->second->refs++;
+                return it->second;
+            }
+            auto str = static_cast<Str*>(malloc(sizeof(Str) + s.size() + 1));
+            str->refs = 1;
+            str->len = s.size();
+            memcpy(str->data(), s.data(), s.size());
+            str->data()[s.size()] = '\0';
+            strs_.emplace(std::string_view(str->data(), s.size()), str);
+            bytes_ += s.size();
+            return str;
+        }
+
+        void get(Str* str) {
+            std::lock_guard<std::mutex> l(mutex_);
+            str->refs++;
+        }
+
+        void put(Str* str) {
+            std::lock_guard<std::mutex> l(mutex_);
+            if (--str->refs) return;
+            strs_.erase(std::string_view(str->data(), str->len));
+            bytes_ -= str->len;
+            free(str);
+        }
+
+        size_t count() {
+            std::lock_guard<std::mutex> l(mutex_);
+            return strs_.size();
+        }
+
+        size_t bytes() {
+            std::lock_guard<std::mutex> l(mutex_);
+            return bytes_;
+        }
+
+    private:
+        std::mutex mutex_;
+        std::unordered_map<std::string_view, Str*> strs_;
+        size_t bytes_ = 0;
+    };
+
+    static Table& table() {
+        static Table table;
+        return table;
+    }
+
+    static Str* intern(std::string_view s) { return table().intern(s); }
+    static void get(Str* str) { table().get(str); }
+    static void put(Str* str) { table().put(str); }
+
+    bool interned() const { return bytes_[max_inline] == interned_tag; }
+
+    void set_inline(const char* s, size_t len) {
+        assert(len <= max_inline);
+        memcpy(bytes_, s, len);
+        memset(bytes_ + len, 0, max_inline - len);
+        bytes_[max_inline] = max_inline - len;
+    }
+
+    void set_interned(Str* str) {
+        str_ = str;
+        bytes_[max_inline] = interned_tag;
+    }
+
+    union {
+        char bytes_[max_inline + 1];
+        Str* str_;
+    };
+};
+
+static_assert(sizeof(Name) == 16);
+
+inline bool operator<(const Name& a, const Name& b) {
+    return a.view() < b.view();
+}
+
+inline bool operator<(const Name& a, std::string_view b) {
+    return a.view() < b;
+}
+
+inline bool operator<(std::string_view a, const Name& b) {
+    return a < b.view();
+}
+
+inline bool operator==(const Name& a, std::string_view b) {
+    return a.view() == b;
+}
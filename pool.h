@@ -0,0 +1,163 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+
+/*
+ * Per-thread free lists of objects of one type.
+ *
+ * Objects that come and go with requests, like file handles, are freed onto
+ * a free list of the thread that frees them and taken from it by the next
+ * allocation on that thread, so once the lists have filled up the heap isn't
+ * touched. A handle is often freed by a different thread than the one that
+ * allocated it, which just moves the memory between lists. Each list keeps at
+ * most `cached` objects and gives the rest back to the heap.
+ *
+ * A type is pooled by routing its operator new and delete here.
+ */
+template <typename T, size_t cached = 256>
+class Pool {
+public:
+    static void* allocate(size_t size) {
+        assert(size == sizeof(T));
+        allocs_.fetch_add(1, std::memory_order_relaxed);
+        List& list = list_;
+        if (Block* b = list.head) {
+            list.head = b->next;
+            list.count--;
+            return b;
+        }
+        heap_allocs_.fetch_add(1, std::memory_order_relaxed);
+        return ::operator new(sizeof(Block));
+    }
+
+    static void deallocate(void* p) {
+        List& list = list_;
+        if (list.count == cached) {
+            ::operator delete(p);
+            return;
+        }
+        Block* b = static_cast<Block*>(p);
+        b->next = list.head;
+        list.head = b;
+        list.count++;
+    }
+
+    // allocations of this type, and how many of them the free lists
+    // couldn't serve. other allocations on the same path aren't counted.
+    static uint64_t allocs() { return allocs_.load(); }
+    static uint64_t heap_allocs() { return heap_allocs_.load(); }
+
+private:
+    union Block {
+        Block* next;
+        alignas(T) char obj[sizeof(T)];
+    };
+
+    struct List {
+        Block* head = nullptr;
+        size_t count = 0;
+
+        ~List() {
+            while (Block* b = head) {
+                head = b->next;
+                ::operator delete(b);
+            }
+        }
+    };
+
+    static thread_local List list_;
+    static inline std::atomic<uint64_t> allocs_{0};
+    static inline std::atomic<uint64_t> heap_allocs_{0};
+};
+
+template <typename T, size_t cached>
+thread_local typename Pool<T, cached>::List Pool<T, cached>::list_;
+
+/*
+ * A per-thread buffer for building replies. It grows to the largest size
+ * asked for and is then reused, so replies don't allocate once a thread has
+ * seen its largest request. The contents only last until the next call on
+ * the same thread.
+ */
+class Scratch {
+public:
+    static char* buffer(size_t size) {
+        thread_local std::unique_ptr<char[]> buf;
+        thread_local size_t capacity = 0;
+        if (size > capacity) {
+            buf.reset(new char[size]);
+            capacity = size;
+            heap_allocs_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return buf.get();
+    }
+
+    static uint64_t heap_allocs() { return heap_allocs_.load(); }
+
+private:
+    static inline std::atomic<uint64_t> heap_allocs_{0};
+};
+
+/*
+ * Objects of one type that live for a long time, like inodes, allocated from
+ * slabs of many objects each, so that they don't pay for a heap header and
+ * rounding apiece. Freed objects are reused by later allocations and the
+ * slabs are kept until exit.
+ */
+template <typename T, size_t per_slab = 256>
+class Slab {
+public:
+    static void* allocate(size_t size) {
+        assert(size == sizeof(T));
+        std::lock_guard<std::mutex> l(mutex_);
+        if (!free_) {
+            Block* slab = static_cast<Block*>(
+              ::operator new(sizeof(Block) * per_slab));
+            for (size_t i = 0; i < per_slab; i++) {
+                slab[i].next = free_;
+                free_ = &slab[i];
+            }
+            slabs_++;
+        }
+        Block* b = free_;
+        free_ = b->next;
+        in_use_++;
+        return b;
+    }
+
+    static void deallocate(void* p) {
+        std::lock_guard<std::mutex> l(mutex_);
+        Block* b = static_cast<Block*>(p);
+        b->next = free_;
+        free_ = b;
+        in_use_--;
+    }
+
+    // objects in use, and the bytes taken by all slabs
+    static size_t in_use() {
+        std::lock_guard<std::mutex> l(mutex_);
+        return in_use_;
+    }
+
+    static size_t bytes() {
+        std::lock_guard<std::mutex> l(mutex_);
+        return slabs_ * per_slab * sizeof(Block);
+    }
+
+private:
+    union Block {
+        Block* next;
+        alignas(T) char obj[sizeof(T)];
+    };
+
+    static inline std::mutex mutex_;
+    static inline Block* free_ = nullptr;
+    static inline size_t slabs_ = 0;
+    static inline size_t in_use_ = 0;
+};
@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+ * Per-uid and per-gid limits on space and on the number of inodes.
+ *
+ * The usage of every uid and gid is kept up to date as files are created,
+ * grow, shrink, change owner and go away, so checking a change against the
+ * limits is a couple of hash table lookups. A change that would take a uid or
+ * gid over one of its limits fails with EDQUOT, while changes that free
+ * something always go through, so a tenant that is over a limit after the
+ * limits were lowered can still clean up.
+ *
+ * The limits are read from a file with a line per tenant:
+ *
+ *   uid 1000 bytes=10G inodes=100000
+ *   gid 100 bytes=100G
+ *   uid * bytes=1G
+ *
+ * where "*" sets the limits of uids without a line of their own. Sizes take
+ * K, M and G suffixes. The file can be reloaded at any time, which keeps the
+ * usage. Nothing here locks; the file system calls it under its lock.
+ */
+class Quota {
+public:
+    struct Limits {
+        uint64_t bytes = 0; // 0 for no limit
+        uint64_t inodes = 0;
+    };
+
+    struct Usage {
+        uint64_t bytes = 0;
+        uint64_t inodes = 0;
+    };
+
+    /*
+     * Replace the limits with those in @path. Returns 0, or -1 with a
+     * description of the problem in @err, in which case nothing changes.
+     */
+    int load(const std::string& path, std::string* err) {
+        FILE* f = fopen(path.c_str(), "r");
+        if (!f) {
+            *err = path + ": " + strerror(errno);
+            return -1;
+        }
+
+        limits_map_t uids, gids;
+        Limits any_uid;
+        bool have_any_uid = false;
+
+        char line[256];
+        int lineno = 0;
+        int ret = 0;
+        while (fgets(line, sizeof(line), f)) {
+            lineno++;
+            char kind[16], who[32];
+            int pos;
+            if (line[0] == '#' || sscanf(line, " %15s", kind) != 1) continue;
+            if (sscanf(line, " %15s %31s%n", kind, who, &pos) != 2) {
+                ret = -1;
+                break;
+            }
+
+            Limits limits;
+            if (parse_limits(line + pos, &limits)) {
+                ret = -1;
+                break;
+            }
+
+            const bool uid = !strcmp(kind, "uid");
+            if (!uid && strcmp(kind, "gid")) {
+                ret = -1;
+                break;
+            }
+
+            if (uid && !strcmp(who, "*")) {
+                any_uid = limits;
+                have_any_uid = true;
+            } else {
+                char* end;
+                unsigned long id = strtoul(who, &end, 10);
+                if (*end) {
+                    ret = -1;
+                    break;
+                }
+                (uid ? uids : gids)[id] = limits;
+            }
+        }
+        fclose(f);
+
+        if (ret) {
+            *err = path + ":" + std::to_string(lineno) + ": bad limits";
+            return ret;
+        }
+
+        uid_limits_.swap(uids);
+        gid_limits_.swap(gids);
+        any_uid_ = any_uid;
+        have_any_uid_ = have_any_uid;
+
+        return 0;
+    }
+
+    /*
+     * Add @bytes and @inodes to the usage of @uid and @gid, or return -EDQUOT
+     * and change nothing if that would take either over its limits.
+     */
+    int charge(uid_t uid, gid_t gid, uint64_t bytes, uint64_t inodes) {
+        Usage& u = uid_usage_[uid];
+        Usage& g = gid_usage_[gid];
+        if (
+          over(u, uid_limits(uid), bytes, inodes)
+          || over(g, gid_limits(gid), bytes, inodes))
+            return -EDQUOT;
+        add(u, bytes, inodes);
+        add(g, bytes, inodes);
+        return 0;
+    }
+
+    void release(uid_t uid, gid_t gid, uint64_t bytes, uint64_t inodes) {
+        sub(uid_usage_[uid], bytes, inodes);
+        sub(gid_usage_[gid], bytes, inodes);
+    }
+
+    // move usage to a new owner, which must have room for it
+    int transfer(
+      uid_t from_uid,
+      gid_t from_gid,
+      uid_t uid,
+      gid_t gid,
+      uint64_t bytes,
+      uint64_t inodes) {
+        Usage& u = uid_usage_[uid];
+        Usage& g = gid_usage_[gid];
+        const bool new_uid = uid != from_uid;
+        const bool new_gid = gid != from_gid;
+        if (
+          (new_uid && over(u, uid_limits(uid), bytes, inodes))
+          || (new_gid && over(g, gid_limits(gid), bytes, inodes)))
+            return -EDQUOT;
+        if (new_uid) {
+            add(u, bytes, inodes);
+            sub(uid_usage_[from_uid], bytes, inodes);
+        }
+        if (new_gid) {
+            add(g, bytes, inodes);
+            sub(gid_usage_[from_gid], bytes, inodes);
+        }
+        return 0;
+    }
+
+    // the usage and limits of every tenant, as "uid N" or "gid N"
+    std::vector<std::pair<std::string, std::pair<Usage, Limits>>> report() {
+        std::vector<std::pair<std::string, std::pair<Usage, Limits>>> ret;
+        for (auto& u : uid_usage_)
+            ret.emplace_back(
+              "uid " + std::to_string(u.first),
+              std::make_pair(u.second, uid_limits(u.first)));
+        for (auto& g : gid_usage_)
+            ret.emplace_back(
+              "gid " + std::to_string(g.first),
+              std::make_pair(g.second, gid_limits(g.first)));
+        return ret;
+    }
+
+private:
+    typedef std::unordered_map<unsigned long, Limits> limits_map_t;
+    typedef std::unordered_map<unsigned long, Usage> usage_map_t;
+
+    static int parse_limits(const char* s, Limits* limits) {
+        char key[16];
+        unsigned long long value;
+        char unit[2];
+        int pos;
+        while (sscanf(s, " %15[a-z]=%llu%n", key, &value, &pos) == 2) {
+            s += pos;
+            if (sscanf(s, "%1[KMG]%n", unit, &pos) == 1) {
+                s += pos;
+                value <<= unit[0] == 'K' ? 10 : unit[0] == 'M' ? 20 : 30;
+            }
+            if (!strcmp(key, "bytes"))
+                limits->bytes = value;
+            else if (!strcmp(key, "inodes"))
+                limits->inodes = value;
+            else
+                return -1;
+        }
+        while (*s == ' ' || *s == '\t' || *s == '\n')
+            s++;
+        return *s ? -1 : 0;
+    }
+
+    static void add(Usage& usage, uint64_t bytes, uint64_t inodes) {
+        usage.bytes += bytes;
+        usage.inodes += inodes;
+    }
+
+    static void sub(Usage& usage, uint64_t bytes, uint64_t inodes) {
+        usage.bytes -= std::min(usage.bytes, bytes);
+        usage.inodes -= std::min(usage.inodes, inodes);
+    }
+
+    static bool
+    over(const Usage& usage, Limits limits, uint64_t bytes, uint64_t inodes) {
+        return (bytes && limits.bytes && usage.bytes + bytes > limits.bytes)
+               || (inodes && limits.inodes
+                   && usage.inodes + inodes > limits.inodes);
+    }
+
+    Limits uid_limits(unsigned long uid) const {
+        auto it = uid_limits_.find(uid);
+        if (it != uid_limits_.end()) return it->second;
+        return have_any_uid_ ? any_uid_ : Limits();
+    }
+
+    Limits gid_limits(unsigned long gid) const {
+        auto it = gid_limits_.find(gid);
+        return it != gid_limits_.end() ? it->second : Limits();
+    }
+
+    limits_map_t uid_limits_;
+    limits_map_t gid_limits_;
+    Limits any_uid_;
+    bool have_any_uid_ = false;
+    usage_map_t uid_usage_;
+    usage_map_t gid_usage_;
+};
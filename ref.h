@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+/*
+ * Reference counting kept in the object itself.
+ *
+ * A Ref owns a reference and a plain pointer borrows one, so code that only
+ * looks at an object while something else keeps it alive passes the pointer
+ * around and doesn't touch the count. Since the count lives in the object, a
+ * borrowed pointer can be turned back into a Ref whenever it needs to be
+ * kept, which shared_ptr can't do without enable_shared_from_this.
+ *
+ * The last reference is dropped with T::destroy, which deletes the object. A
+ * type can hide it with its own, for example to delete a subclass without
+ * making the destructor virtual.
+ */
+template <typename T>
+class RefCounted {
+public:
+    void get_ref() const { refs_.fetch_add(1, std::memory_order_relaxed); }
+
+    void put_ref() const {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            T::destroy(static_cast<const T*>(this));
+    }
+
+    static void destroy(const T* p) { delete p; }
+
+protected:
+    RefCounted() = default;
+    RefCounted(const RefCounted&) = delete;
+    RefCounted& operator=(const RefCounted&) = delete;
+
+private:
+    mutable std::atomic<unsigned> refs_{0};
+};
+
+template <typename T>
+class Ref {
+public:
+    Ref() = default;
+    Ref(std::nullptr_t) {}
+
+    Ref(T* p)
+      : p_(p) {
+        if (p_) p_->get_ref();
+    }
+
+    Ref(const Ref& other)
+      : Ref(other.p_) {}
+
+    Ref(Ref&& other)
+      : p_(other.p_) {
+        other.p_ = nullptr;
+    }
+
+    template <typename U>
+    Ref(const Ref<U>& other)
+      : Ref(other.get()) {}
+
+    ~Ref() {
+        if (p_) p_->put_ref();
+    }
+
+    Ref& operator=(Ref other) {
+        std::swap(p_, other.p_);
+        return *this;
+    }
+
+    T* get() const { return p_; }
+    T* operator->() const { return p_; }
+    T& operator*() const { return *p_; }
+    explicit operator bool() const { return p_; }
+
+    void reset() { *this = nullptr; }
+
+private:
+    T* p_ = nullptr;
+};
+
+template <typename T, typename... Args>
+Ref<T> make_ref(Args&&... args) {
+    return Ref<T>(new T(std::forward<Args>(args)...));
+}
+
+template <typename T, typename U>
+Ref<T> static_ref_cast(const Ref<U>& ref) {
+    return Ref<T>(static_cast<T*>(ref.get()));
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Admission control for requests.
+ *
+ * Requests are split into classes: metadata, small reads and writes, and bulk
+ * reads and writes. At most `slots` requests run at once, and each class has
+ * a budget of how many of those it may hold. A request that can't run waits
+ * in the queue of its class, and when a slot frees up it goes to the oldest
+ * waiter of the most important class that is under its budget. Metadata comes
+ * first, and bulk transfers are held to a budget below the number of slots,
+ * so a few large streams can't keep a stat waiting behind them.
+ *
+ * A request that is admitted right away runs on the thread that received it.
+ * One that has to wait is queued as a task, with copies of its arguments,
+ * and the receiving thread goes back to reading requests. That way waiting
+ * requests never tie up the threads that libfuse reads the device with.
+ * Queued tasks run on a pool of `slots` workers once they are admitted, which
+ * is always enough as every task that is handed to a worker holds a slot.
+ */
+class Scheduler {
+public:
+    enum op_class { META, SMALL_IO, BULK_IO, NUM_CLASSES };
+
+    // runs holding a slot of its class, and gives it back with exit()
+    typedef std::function<void()> Task;
+
+    Scheduler(unsigned slots, unsigned small_budget, unsigned bulk_budget)
+      : slots_(slots) {
+        queues_[META].budget = slots;
+        queues_[SMALL_IO].budget = std::max(1u, small_budget);
+        queues_[BULK_IO].budget = std::max(1u, bulk_budget);
+        for (unsigned i = 0; i < slots; i++)
+            workers_.emplace_back(&Scheduler::work, this);
+    }
+
+    ~Scheduler() { stop(); }
+
+    // holds a slot for as long as it lives, if it was given one
+    class Ticket {
+    public:
+        Ticket()
+          : admitted_(false) {}
+
+        Ticket(Scheduler* sched, op_class c)
+          : sched_(sched)
+          , class_(c)
+          , admitted_(true) {}
+
+        Ticket(Ticket&& other)
+          : sched_(other.sched_)
+          , class_(other.class_)
+          , admitted_(other.admitted_) {
+            other.admitted_ = false;
+        }
+
+        ~Ticket() {
+            if (admitted_ && sched_) sched_->exit(class_);
+        }
+
+        Ticket(const Ticket&) = delete;
+        Ticket& operator=(const Ticket&) = delete;
+
+        // false if the request was queued to run later
+        explicit operator bool() const { return admitted_; }
+
+    private:
+        Scheduler* sched_ = nullptr;
+        op_class class_ = META;
+        bool admitted_;
+    };
+
+    // take a slot if one can be had without waiting
+    bool try_enter(op_class c) {
+        std::lock_guard<std::mutex> l(mutex_);
+        return enter(c);
+    }
+
+    // run @task once it is admitted. it may already be by the time this
+    // returns, if a slot freed up in the meantime.
+    void defer(op_class c, Task task) {
+        std::lock_guard<std::mutex> l(mutex_);
+        if (enter(c)) {
+            ready_.push_back(std::move(task));
+            cv_.notify_one();
+            return;
+        }
+        queues_[c].waiting.push_back(std::move(task));
+    }
+
+    void exit(op_class c) {
+        std::lock_guard<std::mutex> l(mutex_);
+        running_--;
+        queues_[c].running--;
+        admit();
+        if (stop_ && !running_) cv_.notify_all();
+    }
+
+    // run whatever is queued, then stop the workers
+    void stop() {
+        {
+            std::lock_guard<std::mutex> l(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto& worker : workers_)
+            worker.join();
+        workers_.clear();
+    }
+
+private:
+    struct Queue {
+        std::deque<Task> waiting;
+        unsigned running = 0;
+        unsigned budget = 0;
+    };
+
+    // run right away unless someone at least as important is waiting
+    bool enter(op_class c) {
+        Queue& q = queues_[c];
+        for (int i = META; i <= c; i++)
+            if (!queues_[i].waiting.empty()) return false;
+        if (running_ >= slots_ || q.running >= q.budget) return false;
+        running_++;
+        q.running++;
+        return true;
+    }
+
+    void admit() {
+        for (auto& q : queues_) {
+            while (
+              running_ < slots_ && !q.waiting.empty() && q.running < q.budget) {
+                ready_.push_back(std::move(q.waiting.front()));
+                q.waiting.pop_front();
+                running_++;
+                q.running++;
+                cv_.notify_one();
+            }
+        }
+    }
+
+    bool idle() const {
+        if (running_ || !ready_.empty()) return false;
+        for (auto& q : queues_)
+            if (!q.waiting.empty()) return false;
+        return true;
+    }
+
+    void work() {
+        std::unique_lock<std::mutex> l(mutex_);
+        for (;;) {
+            cv_.wait(l, [&] { return !ready_.empty() || (stop_ && idle()); });
+            if (ready_.empty()) return;
+            Task task = std::move(ready_.front());
+            ready_.pop_front();
+            l.unlock();
+            task();
+            task = nullptr;
+            l.lock();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    const unsigned slots_;
+    unsigned running_ = 0;
+    Queue queues_[NUM_CLASSES];
+    std::deque<Task> ready_;
+    std::vector<std::thread> workers_;
+    bool stop_ = false;
+};
@@ -4,10 +4,11 @@ set -x
 
 fs=${1}
 script=${2}
+opts=${3:+,${3}}
 size=1610612736
 dir=$(mktemp -d)
 
-${fs} -o size=${size} ${dir} &
+${fs} -o size=${size}${opts} ${dir} &
 pid=$!
 
 function cleanup() {
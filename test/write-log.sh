@@ -0,0 +1,20 @@
+#!/bin/bash
+set -e
+set -x
+
+# a small overwrite that can't be logged because the file system is full, or
+# the owner is out of quota, goes straight to the file. data logged before it
+# must not be replayed over it.
+
+head -c 8192 /dev/zero | tr '\0' a > f
+head -c 4096 /dev/zero | tr '\0' b | dd of=f bs=4096 iflag=fullblock conv=notrunc
+
+# fill up, then take what is left with a logged overwrite of its own
+dd if=/dev/urandom of=fill bs=1M || true
+dd if=/dev/urandom of=fill bs=4096 count=1 conv=notrunc
+
+head -c 4096 /dev/zero | tr '\0' c | dd of=f bs=4096 iflag=fullblock conv=notrunc
+
+cmp f <(head -c 4096 /dev/zero | tr '\0' c; head -c 4096 /dev/zero | tr '\0' a)
+
+rm f fill
@@ -0,0 +1,353 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+/*
+ * Per-uid and per-gid limits on bandwidth and request rate.
+ *
+ * Each limited uid and gid has a token bucket for bytes and one for requests,
+ * refilled at the configured rate and holding up to a second's worth. A
+ * request takes its tokens up front, even if that leaves the bucket in debt,
+ * and is then held until the debt would be repaid. Requests are never failed.
+ * Later requests see the debt of earlier ones, so a busy tenant's requests
+ * queue behind each other in arrival order.
+ *
+ * Held requests are parked on a timer rather than keeping the thread that
+ * received it, so other tenants' requests don't wait for a free thread behind
+ * them. When its wait is over a request is handed to a pool of workers. The
+ * timer never runs one itself, so a slow request can't hold up the others
+ * that come due after it.
+ *
+ * The limits are read from a file with a line per tenant:
+ *
+ *   uid 1000 bytes=10M iops=500
+ *   gid 100 bytes=100M
+ *   uid * iops=2000
+ *
+ * where "*" sets the limits of uids without a line of their own, each of
+ * which gets its own buckets. Rates are per second and take K, M and G
+ * suffixes. The file can be reloaded at any time, which resets the buckets.
+ */
+class Throttle {
+public:
+    typedef std::chrono::steady_clock clock;
+    typedef std::function<void()> Task;
+
+    explicit Throttle(
+      unsigned workers = std::max(2u, std::thread::hardware_concurrency()))
+      : timer_(&Throttle::run_held, this) {
+        for (unsigned i = 0; i < workers; i++)
+            workers_.emplace_back(&Throttle::work, this);
+    }
+
+    ~Throttle() { stop(); }
+
+    struct Limits {
+        double bytes = 0; // per second, 0 for no limit
+        double iops = 0;
+    };
+
+    struct Stats {
+        uint64_t requests = 0;
+        uint64_t bytes = 0;
+        uint64_t delayed = 0;
+        double delay = 0; // seconds
+    };
+
+    /*
+     * Replace the limits with those in @path. Returns 0, or -1 with a
+     * description of the problem in @err, in which case nothing changes.
+     */
+    int load(const std::string& path, std::string* err) {
+        FILE* f = fopen(path.c_str(), "r");
+        if (!f) {
+            *err = path + ": " + strerror(errno);
+            return -1;
+        }
+
+        limits_map_t uids, gids;
+        Limits any_uid;
+        bool have_any_uid = false;
+
+        char line[256];
+        int lineno = 0;
+        int ret = 0;
+        while (fgets(line, sizeof(line), f)) {
+            lineno++;
+            char kind[16], who[32];
+            int pos;
+            if (line[0] == '#' || sscanf(line, " %15s", kind) != 1) continue;
+            if (sscanf(line, " %15s %31s%n", kind, who, &pos) != 2) {
+                ret = -1;
+                break;
+            }
+
+            Limits limits;
+            if (parse_limits(line + pos, &limits)) {
+                ret = -1;
+                break;
+            }
+
+            const bool uid = !strcmp(kind, "uid");
+            if (!uid && strcmp(kind, "gid")) {
+                ret = -1;
+                break;
+            }
+
+            if (uid && !strcmp(who, "*")) {
+                any_uid = limits;
+                have_any_uid = true;
+            } else {
+                char* end;
+                unsigned long id = strtoul(who, &end, 10);
+                if (*end) {
+                    ret = -1;
+                    break;
+                }
+                (uid ? uids : gids)[id] = limits;
+            }
+        }
+        fclose(f);
+
+        if (ret) {
+            *err = path + ":" + std::to_string(lineno) + ": bad limits";
+            return ret;
+        }
+
+        std::lock_guard<std::mutex> l(mutex_);
+        uid_limits_.swap(uids);
+        gid_limits_.swap(gids);
+        any_uid_ = any_uid;
+        have_any_uid_ = have_any_uid;
+        uid_buckets_.clear();
+        gid_buckets_.clear();
+
+        return 0;
+    }
+
+    /*
+     * Take the tokens for a request of @bytes by @uid and @gid, and return
+     * how long it has to be held before it may go ahead, in seconds.
+     */
+    double charge(uid_t uid, gid_t gid, size_t bytes) {
+        std::lock_guard<std::mutex> l(mutex_);
+        const auto now = clock::now();
+        double wait = 0;
+
+        auto it = uid_limits_.find(uid);
+        if (it != uid_limits_.end())
+            wait = take(uid_buckets_, uid, it->second, now, bytes);
+        else if (have_any_uid_)
+            wait = take(uid_buckets_, uid, any_uid_, now, bytes);
+
+        it = gid_limits_.find(gid);
+        if (it != gid_limits_.end())
+            wait = std::max(
+              wait, take(gid_buckets_, gid, it->second, now, bytes));
+
+        if (wait > 0) {
+            if (auto b = bucket(uid_buckets_, uid)) record(b, wait);
+            if (auto b = bucket(gid_buckets_, gid)) record(b, wait);
+        }
+
+        return wait;
+    }
+
+    // run @task on a worker once @wait seconds have passed
+    void hold(double wait, Task task) {
+        const auto due = clock::now()
+                         + std::chrono::duration_cast<clock::duration>(
+                           std::chrono::duration<double>(wait));
+        {
+            std::unique_lock<std::mutex> l(held_mutex_);
+            if (stop_) {
+                l.unlock();
+                task();
+                return;
+            }
+            held_.emplace(due, std::move(task));
+        }
+        timer_cv_.notify_one();
+    }
+
+    // run whatever is held without waiting any longer, and stop the threads
+    void stop() {
+        {
+            std::lock_guard<std::mutex> l(held_mutex_);
+            stop_ = true;
+        }
+        timer_cv_.notify_one();
+        if (timer_.joinable()) timer_.join();
+        for (auto& worker : workers_)
+            worker.join();
+        workers_.clear();
+    }
+
+    // the stats of every limited tenant, as "uid N" or "gid N"
+    std::vector<std::pair<std::string, Stats>> stats() {
+        std::lock_guard<std::mutex> l(mutex_);
+        std::vector<std::pair<std::string, Stats>> ret;
+        for (auto& b : uid_buckets_)
+            ret.emplace_back("uid " + std::to_string(b.first), b.second.stats);
+        for (auto& b : gid_buckets_)
+            ret.emplace_back("gid " + std::to_string(b.first), b.second.stats);
+        return ret;
+    }
+
+private:
+    struct Bucket {
+        double bytes = 0;
+        double ops = 0;
+        clock::time_point last;
+        Stats stats;
+    };
+
+    typedef std::map<unsigned long, Limits> limits_map_t;
+    typedef std::map<unsigned long, Bucket> bucket_map_t;
+
+    static int parse_limits(const char* s, Limits* limits) {
+        char key[16];
+        double value;
+        char unit[2];
+        int pos;
+        while (sscanf(s, " %15[a-z]=%lf%n", key, &value, &pos) == 2) {
+            s += pos;
+            if (sscanf(s, "%1[KMG]%n", unit, &pos) == 1) {
+                s += pos;
+                value *= unit[0] == 'K' ? 1e3 : unit[0] == 'M' ? 1e6 : 1e9;
+            }
+            if (value < 0) return -1;
+            if (!strcmp(key, "bytes"))
+                limits->bytes = value;
+            else if (!strcmp(key, "iops"))
+                limits->iops = value;
+            else
+                return -1;
+        }
+        while (*s == ' ' || *s == '\t' || *s == '\n')
+            s++;
+        return *s ? -1 : 0;
+    }
+
+    // hand requests to the workers as they come due, or all of them on stop
+    void run_held() {
+        std::unique_lock<std::mutex> l(held_mutex_);
+        for (;;) {
+            while (!held_.empty()
+                   && (stop_ || held_.begin()->first <= clock::now())) {
+                ready_.push_back(std::move(held_.begin()->second));
+                held_.erase(held_.begin());
+                ready_cv_.notify_one();
+            }
+
+            if (stop_) {
+                ready_cv_.notify_all();
+                return;
+            }
+
+            if (held_.empty())
+                timer_cv_.wait(l);
+            else
+                timer_cv_.wait_until(l, held_.begin()->first);
+        }
+    }
+
+    void work() {
+        std::unique_lock<std::mutex> l(held_mutex_);
+        for (;;) {
+            ready_cv_.wait(l, [&] {
+                return !ready_.empty() || (stop_ && held_.empty());
+            });
+            if (ready_.empty()) return;
+            Task task = std::move(ready_.front());
+            ready_.pop_front();
+            l.unlock();
+            task();
+            task = nullptr;
+            l.lock();
+        }
+    }
+
+    static Bucket* bucket(bucket_map_t& buckets, unsigned long id) {
+        auto it = buckets.find(id);
+        return it == buckets.end() ? nullptr : &it->second;
+    }
+
+    static void record(Bucket* b, double wait) {
+        b->stats.delayed++;
+        b->stats.delay += wait;
+    }
+
+    /*
+     * Take the tokens for a request from the buckets of @id and return how
+     * long the request has to wait for them, in seconds.
+     */
+    static double take(
+      bucket_map_t& buckets,
+      unsigned long id,
+      const Limits& limits,
+      clock::time_point now,
+      size_t bytes) {
+        auto res = buckets.emplace(id, Bucket());
+        Bucket& b = res.first->second;
+        if (res.second) {
+            b.bytes = limits.bytes;
+            b.ops = limits.iops;
+            b.last = now;
+        }
+
+        const double elapsed
+          = std::chrono::duration<double>(now - b.last).count();
+        b.last = now;
+
+        b.stats.requests++;
+        b.stats.bytes += bytes;
+
+        double wait = 0;
+        if (limits.bytes > 0) {
+            b.bytes = std::min(limits.bytes, b.bytes + elapsed * limits.bytes);
+            b.bytes -= bytes;
+            if (b.bytes < 0) wait = -b.bytes / limits.bytes;
+        }
+        if (limits.iops > 0) {
+            b.ops = std::min(limits.iops, b.ops + elapsed * limits.iops);
+            b.ops -= 1;
+            if (b.ops < 0) wait = std::max(wait, -b.ops / limits.iops);
+        }
+
+        return wait;
+    }
+
+    std::mutex mutex_;
+    limits_map_t uid_limits_;
+    limits_map_t gid_limits_;
+    Limits any_uid_;
+    bool have_any_uid_ = false;
+    bucket_map_t uid_buckets_;
+    bucket_map_t gid_buckets_;
+
+    // held requests by when they may go ahead, and those that may
+    std::mutex held_mutex_;
+    std::condition_variable timer_cv_;
+    std::condition_variable ready_cv_;
+    std::multimap<clock::time_point, Task> held_;
+    std::deque<Task> ready_;
+    bool stop_ = false;
+    std::thread timer_;
+    std::vector<std::thread> workers_;
+};